@@ -33,6 +33,10 @@ if /I "%~1" NEQ "debug" (
     call :clean
 )
 
+if /I "%~1" EQU "bench" (
+    %file%.exe bench > bench.json
+)
+
 setlocal disabledelayedexpansion
 goto :eof
 
@@ -10,7 +10,7 @@ if [ "$CC" = "" ]; then
 fi
 
 DEFINES="-D_POSIX_C_SOURCE=200809L -D_DEFAULT_SOURCE"
-FLAGS="-std=c99 $DEFINES -Wall -Wextra -pedantic -lm"
+FLAGS="-std=c99 $DEFINES -Wall -Wextra -pedantic -pthread -lm"
 D_FLAGS="-g -ggdb" # debug info tuned for gdb
 R_FLAGS="-DNDEBUG -O2 -s"
 file="wavgen"
@@ -27,3 +27,7 @@ printf "\033[1;44mBuilding wavgen in $mode mode...\033[0m\n"
 
 set -x
 $CC -o $file $file.c $args || exit 1
+
+if [ "$1" = "bench" ]; then
+    ./$file bench > bench.json || exit 1
+fi
@@ -1,3 +1,7 @@
+#if defined __linux__
+#define _GNU_SOURCE // O_DIRECT
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -7,23 +11,69 @@
 #include <ctype.h>
 #include <math.h>
 #include <limits.h>
+#include <float.h>
 #include <time.h>
 #include <errno.h>
+#include <signal.h>
+
+#if defined _WIN32
+#include <windows.h>
+#include <io.h>
+#include <malloc.h>
+#include <fcntl.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#endif
+
+/* io_uring is driven through its raw system calls, so it only needs the
+   kernel headers (and is left out when they're too old to have it) */
+#if defined __linux__ && defined __has_include
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+
+#if (defined __GNUC__ || defined __clang__) && \
+    (defined __x86_64__ || defined __i386__)
+#define SIMD_X86
+#include <immintrin.h>
+#elif defined __aarch64__
+#define SIMD_NEON
+#include <arm_neon.h>
+#endif
 
 typedef struct WavHeader {
     char chunkID[4];
-    int32_t chunkSize;
+    uint32_t chunkSize;
     char format[4];
     char subChunk1ID[4];
-    int32_t subChunk1Size;
-    int16_t audioFormat;
-    int16_t numChannels;
-    int32_t sampleRate;
-    int32_t byteRate;
-    int16_t blockAlign;
-    int16_t bitsPerSample;
+    uint32_t subChunk1Size;
+    uint16_t audioFormat;
+    uint16_t numChannels;
+    uint32_t sampleRate;
+    uint32_t byteRate;
+    uint16_t blockAlign;
+    uint16_t bitsPerSample;
+    /* WAVE_FORMAT_EXTENSIBLE only (multichannel files) */
+    uint16_t extensionSize;
+    uint16_t validBitsPerSample;
+    uint32_t channelMask;
+    uint16_t subFormat;
     char subChunk2ID[4];
-    int32_t subChunk2Size;
+    uint32_t subChunk2Size;
+    /* 64-bit sizes, only written out (in a ds64 chunk) for RF64 files */
+    uint64_t riffSize;
+    uint64_t dataSize;
+    uint64_t sampleCount;
 } WavHeader;
 
 typedef enum WaveType {
@@ -31,7 +81,11 @@ typedef enum WaveType {
     WAVE_TRIANGLE,
     WAVE_SQUARE,
     WAVE_SAW,
-    WAVE_EVEN
+    WAVE_EVEN,
+    WAVE_WHITE_NOISE,
+    WAVE_PINK_NOISE,
+    WAVE_BROWN_NOISE,
+    WAVE_BAND_NOISE
 } WaveType;
 
 typedef enum SampleFormat {
@@ -39,6 +93,65 @@ typedef enum SampleFormat {
     FMT_FLOAT_PCM = 3
 } SampleFormat;
 
+typedef enum OscillatorMode {
+    OSC_RECURRENCE,
+    OSC_LIBM
+} OscillatorMode;
+
+typedef enum SynthesisMode {
+    SYNTH_WAVETABLE,
+    SYNTH_EXACT
+} SynthesisMode;
+
+typedef enum RenderMode {
+    RENDER_CHUNK,
+    RENDER_STREAM
+} RenderMode;
+
+typedef enum PeakMode {
+    PEAK_AUTO,
+    PEAK_EXACT,
+    PEAK_ANALYTIC
+} PeakMode;
+
+typedef enum SamplePrecision {
+    PRECISION_FLOAT,
+    PRECISION_DOUBLE
+} SamplePrecision;
+
+typedef enum SweepMode {
+    SWEEP_NONE,
+    SWEEP_LINEAR,
+    SWEEP_EXPONENTIAL
+} SweepMode;
+
+typedef enum SimdLevel {
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2,
+    SIMD_AVX512,
+    SIMD_NEON,
+    SIMD_AUTO
+} SimdLevel;
+
+typedef enum OutputBackend {
+    OUT_AUTO,
+    OUT_STDIO,
+    OUT_MMAP,
+    OUT_URING
+} OutputBackend;
+
+#define MAX_CHANNELS 8
+
+/* each channel renders its own tone set, normalized to its own peak */
+typedef struct Channel {
+    double *freqs;
+    size_t freqCount;
+    WaveType waveType;
+    double amplitude;
+    uint32_t index; // position in the frame (which keys its noise)
+} Channel;
+
 typedef struct Parameters {
     double *freqs;
     size_t freqCount;
@@ -49,20 +162,67 @@ typedef struct Parameters {
     SampleFormat sampleFormat;
     WaveType waveType;
     bool applyDither;
+    uint64_t ditherSeed;
     char *outputFile;
+    OscillatorMode oscillator;
+    SynthesisMode synthesis;
+    RenderMode renderMode;
+    PeakMode peakMode;
+    SamplePrecision precision; // of the samples between synthesis and output
+    SweepMode sweep;
+    double sweepFreqs[2]; // start and end, swept by every channel's wave
+    uint64_t noiseSeed;
+    double noiseBand[2]; // edges of band-limited noise
+    char *cacheDir; // where finished chunks are kept (NULL -> not kept)
+    uint64_t cacheLimit; // bytes the kept chunks may take up together
+    uint32_t threadCount;
+    OutputBackend outputBackend;
+    int outputFd; // written to instead of 'outputFile' when >= 0
+    uint32_t channelCount;
+    uint32_t channelMask; // speaker positions (0 -> default for the count)
+    Channel channels[MAX_CHANNELS];
 } Parameters;
 
+/* 'sampleCount' counts frames (one sample per channel, interleaved) */
 typedef struct AudioBuffer {
     void *buf;
     size_t sampleCount;
-    size_t bytesPerSample;
+    size_t bytesPerFrame;
 } AudioBuffer;
 
+/* planar: channel 'c' takes up buf[c * plane, c * plane + sampleCount), in
+   the wave's sample precision, its samples left as rendered and 'gains[c]'
+   being what brings them to its amplitude (applied by whichever pass touches
+   them next) */
 typedef struct WaveChunk {
-    double *buf;
+    void *buf;
+    size_t plane;
     size_t sampleCount;
+    size_t channelCount;
+    double gains[MAX_CHANNELS];
 } WaveChunk;
 
+typedef struct OutputQueue OutputQueue;
+typedef struct OutputRing OutputRing;
+
+/* the stdio backend hands out blocks to be filled and then written by a
+   writer thread (or a single staging buffer, written on the spot, when there
+   is none), the uring one hands out buffers registered with the kernel, and
+   the mmap one hands out the file's own (preallocated) memory */
+typedef struct Output {
+    OutputBackend backend;
+    const char *path;
+    FILE *file;
+    OutputQueue *queue;
+    OutputRing *ring;
+    uint8_t *staging;
+    size_t stagingSize;
+    uint8_t *map;
+    int fd;
+    size_t size;
+    size_t offset;
+} Output;
+
 typedef enum LogState {
     LOG_INIT,
     LOG_INFO,
@@ -73,52 +233,160 @@ typedef enum LogState {
     LOG_EXIT
 } LogState;
 
+/* timed stages of the pipeline, which the summary at loggerClose (and the
+   optional trace file) break the run down into */
+typedef enum StatSpan {
+    SPAN_PARSE,
+    SPAN_RENDER,
+    SPAN_PEAK,
+    SPAN_DITHER,
+    SPAN_QUANTIZE,
+    SPAN_WRITE,
+    SPAN_COUNT
+} StatSpan;
+
+typedef enum StatCounter {
+    COUNTER_SAMPLES, // rendered, per channel
+    COUNTER_PARTIALS, // harmonics summed into those samples
+    COUNTER_BYTES, // written out
+    COUNTER_COUNT
+} StatCounter;
+
+void statsInit(void);
+void statsTrace(const char *file);
+void statsReport(void);
+double spanBegin(void);
+void spanEnd(StatSpan span, double begin);
+void counterAdd(StatCounter counter, uint64_t n);
 void loggerInit(const char *file);
+void loggerConsole(FILE *console);
+void loggerQuiet(bool quiet);
+void loggerScope(const char *name, char *issues, size_t size);
 void loggerClose(int32_t code);
 void loggerAppend(LogState state, const char *restrict fmt, ...);
 WavHeader wavHeaderBuild(const Parameters *params);
+size_t wavHeaderSerialize(const WavHeader *h, uint8_t *dst);
 Parameters parametersParse(const char *file);
 void parametersDestroy(Parameters *p);
+SamplePrecision samplePrecision(const Parameters *p);
 WaveChunk waveChunkGenerate(const Parameters *p);
 AudioBuffer audioBufferBuild(const Parameters *p);
 void audioBufferDestroy(AudioBuffer *b);
+void waveChunkWrite(const Parameters *p, Output *out);
+void waveStreamWrite(const Parameters *p, Output *out);
+void waveWrite(const Parameters *p, Output *out);
+int batchRun(const char *manifest, long threadCount, SimdLevel simd);
+int benchRun(int argc, char **argv);
+Output outputOpen(const char *path, size_t size, OutputBackend backend);
+bool outputTryOpen(Output *o, const char *path, size_t size,
+    OutputBackend backend);
+Output outputOpenFd(int fd);
+void *outputAcquire(Output *o, size_t bytes);
+void outputCommit(Output *o, size_t bytes);
+void outputWrite(Output *o, const void *buf, size_t bytes);
+void outputClose(Output *o);
 void logWaveProperties(const Parameters *p);
+void oscillatorAccuracyReport(const Parameters *p);
+void wavetablesInit(void);
+void wavetablesDestroy(void);
+void workerPoolInit(size_t threads);
+void workerPoolDestroy(void);
+SimdLevel simdInit(SimdLevel requested);
+SimdLevel parseSimdLevel(const char *arg);
+long parseThreadCount(const char *arg);
 
 #define LOG_FILE_NAME "log.txt"
-#define STATIC_ASSERT(condition) ((void)sizeof(char[1 - 2 * !(condition)]))
+#define WAV_HEADER_MAX 128
 
-int main(void)
+int main(int argc, char **argv)
 {
-    STATIC_ASSERT(sizeof(WavHeader) == 44); // header must be 44 bytes long
-    loggerInit(LOG_FILE_NAME);
-
-    Parameters p = parametersParse("config.cfg");
-    logWaveProperties(&p);
-    WavHeader header = wavHeaderBuild(&p);
-    AudioBuffer buf = audioBufferBuild(&p);
+    /* the console log must stay off stdout when the wave (or the benchmark
+       report) is written there, which has to be known before the first
+       message is logged */
+    bool bench = argc > 1 && strcmp(argv[1], "bench") == 0;
+    if (bench) loggerConsole(stderr);
+    for (int i = 1; i < argc; i++) {
+        bool fdIsStdout = strcmp(argv[i], "--fd") == 0 && i + 1 < argc &&
+            strtol(argv[i + 1], NULL, 10) == 1;
+        if (strcmp(argv[i], "--stdout") == 0 || fdIsStdout) {
+            loggerConsole(stderr);
+        }
+    }
 
-    fclose(fopen(p.outputFile, "w")); // clear file's contents if it exists
-    FILE *f = fopen(p.outputFile, "ab"); // open it in append-binary mode
-    if (f == NULL) {
-        loggerAppend(ERR_FATAL, "unable to open file '%s' for writing: %s",
-            p.outputFile, strerror(errno));
-        loggerClose(errno);
-        exit(EXIT_FAILURE);
+    loggerInit(LOG_FILE_NAME);
+    if (bench) {
+        wavetablesInit();
+        int code = benchRun(argc - 2, argv + 2);
+        workerPoolDestroy();
+        wavetablesDestroy();
+        loggerClose(code);
+        return code;
     }
 
-    loggerAppend(LOG_INFO, "writing wave to file on disk");
-    fwrite(&header, sizeof(header), 1, f);
-    double chunks = p.sampleRate * p.durationSecs / buf.sampleCount;
-    for (size_t i = 0; i < (size_t)chunks; i++) {
-        fwrite(buf.buf, buf.bytesPerSample, buf.sampleCount, f);
+    bool accuracyReport = false;
+    const char *batchFile = NULL;
+    long outputFd = -1;
+    long threadCount = -1;
+    SimdLevel simd = SIMD_AUTO;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--accuracy") == 0) {
+            accuracyReport = true;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threadCount = parseThreadCount(argv[++i]);
+        } else if (strcmp(argv[i], "--simd") == 0 && i + 1 < argc) {
+            simd = parseSimdLevel(argv[++i]);
+        } else if (strcmp(argv[i], "--stdout") == 0) {
+            outputFd = 1;
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batchFile = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            statsTrace(argv[++i]);
+        } else if (strcmp(argv[i], "--fd") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            outputFd = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || outputFd < 0 || outputFd > INT_MAX) {
+                loggerAppend(ERR_ARG,
+                    "invalid file descriptor '%s' (ignoring)", argv[i]);
+                outputFd = -1;
+            }
+        } else {
+            loggerAppend(ERR_ARG,
+                "unrecognized argument '%s' (ignoring)", argv[i]);
+        }
     }
 
-    double trailingChunk = chunks - (size_t)chunks;
-    if (trailingChunk > 0.0) {
-        fwrite(buf.buf, buf.bytesPerSample, buf.sampleCount * trailingChunk, f);
+    wavetablesInit();
+    if (batchFile != NULL) {
+        int code = batchRun(batchFile, threadCount, simd);
+        workerPoolDestroy();
+        wavetablesDestroy();
+        loggerClose(code);
+        return code;
     }
 
-    fclose(f);
+    double parseStart = spanBegin();
+    Parameters p = parametersParse("config.cfg");
+    spanEnd(SPAN_PARSE, parseStart);
+    if (threadCount >= 0) p.threadCount = (uint32_t)threadCount;
+    if (outputFd >= 0) p.outputFd = (int)outputFd;
+    workerPoolInit(p.threadCount);
+    simdInit(simd);
+    logWaveProperties(&p);
+    if (accuracyReport) oscillatorAccuracyReport(&p);
+    WavHeader header = wavHeaderBuild(&p);
+    uint8_t headerBytes[WAV_HEADER_MAX];
+    size_t headerSize = wavHeaderSerialize(&header, headerBytes);
+    size_t fileSize = headerSize + (size_t)header.dataSize;
+    Output out = p.outputFd >= 0 ? outputOpenFd(p.outputFd) :
+        outputOpen(p.outputFile, fileSize, p.outputBackend);
+
+    loggerAppend(LOG_INFO, "writing wave to %s",
+        p.outputFd >= 0 ? "file descriptor" : "file on disk");
+    outputWrite(&out, headerBytes, headerSize);
+    waveWrite(&p, &out);
+    outputClose(&out);
+    workerPoolDestroy();
+    wavetablesDestroy();
     loggerClose(0);
     return 0;
 }
@@ -127,11 +395,112 @@ int main(void)
 
 char *readFileContents(const char *restrict file, FILE *f);
 
+#if defined _WIN32
+typedef HANDLE Thread;
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Cond;
+#define THREAD_FUNC(name) DWORD WINAPI name(LPVOID arg)
+#define mutexInit(m) InitializeCriticalSection(m)
+#define mutexDestroy(m) DeleteCriticalSection(m)
+#define mutexLock(m) EnterCriticalSection(m)
+#define mutexUnlock(m) LeaveCriticalSection(m)
+#define condInit(c) InitializeConditionVariable(c)
+#define condDestroy(c) ((void)(c))
+#define condWait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define condBroadcast(c) WakeAllConditionVariable(c)
+typedef DWORD ThreadId;
+#define threadSelf() GetCurrentThreadId()
+#define threadIdEqual(a, b) ((a) == (b))
+#define threadYield() SwitchToThread()
+#else
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Cond;
+#define THREAD_FUNC(name) void *name(void *arg)
+#define mutexInit(m) pthread_mutex_init(m, NULL)
+#define mutexDestroy(m) pthread_mutex_destroy(m)
+#define mutexLock(m) pthread_mutex_lock(m)
+#define mutexUnlock(m) pthread_mutex_unlock(m)
+#define condInit(c) pthread_cond_init(c, NULL)
+#define condDestroy(c) pthread_cond_destroy(c)
+#define condWait(c, m) pthread_cond_wait(c, m)
+#define condBroadcast(c) pthread_cond_broadcast(c)
+typedef pthread_t ThreadId;
+#define threadSelf() pthread_self()
+#define threadIdEqual(a, b) pthread_equal(a, b)
+#define threadYield() sched_yield()
+#endif
+bool threadCreate(Thread *t, THREAD_FUNC((*fn)), void *arg);
+void threadJoin(Thread t);
+
+/* messages are formatted by whichever thread logs them into a slot of a
+   bounded ring, and written out (to the file and the console) by a flusher
+   thread, so logging from the render path costs a vsnprintf */
+#define LOG_RING_SLOTS 256 // must be a power of 2
+#define LOG_MESSAGE_MAX (2 * KB)
+
+/* a slot is free for the producer claiming position 'pos' when its sequence
+   equals 'pos', and holds a message for the consumer when it's 'pos + 1' */
+typedef struct LogSlot {
+    uint64_t sequence;
+    LogState state;
+    char text[LOG_MESSAGE_MAX];
+} LogSlot;
+
+typedef struct LogRing {
+    LogSlot slots[LOG_RING_SLOTS];
+    uint64_t head; // next position to claim (producers)
+    uint64_t tail; // next position to flush (the flusher alone)
+    uint64_t dropped; // informational messages lost to a full ring
+    bool sleeping; // the flusher is (about to be) waiting on 'wake'
+    bool quit;
+    bool running;
+    Mutex lock;
+    Cond wake;
+    Thread flusher;
+} LogRing;
+
 static FILE *logFile = NULL;
+static FILE *logConsole = NULL;
+static bool logQuiet = false;
+static size_t logBytes = 0;
+static LogRing logRing;
+
+/* where the errors of a single batch job go while its config is parsed */
+typedef struct LogScope {
+    const char *name; // what they're prefixed with (NULL -> nothing)
+    char *issues; // what they're collected in (NULL -> no scope)
+    size_t size;
+} LogScope;
+
+static LogScope logScope = {0};
+
+void loggerConsole(FILE *console)
+{
+    logConsole = console;
+}
+
+/* drops informational messages (errors still get through), for when they'd
+   come from many jobs at once */
+void loggerQuiet(bool quiet)
+{
+    logQuiet = quiet;
+}
+
+/* until it's called again with NULL 'issues', prefixes every error with
+   'name' (if any) and also appends them to the string in 'issues', "; "
+   apart; only for code that runs on its own, like the config being parsed */
+void loggerScope(const char *name, char *issues, size_t size)
+{
+    logScope = (LogScope){ .name = name, .issues = issues, .size = size };
+}
+
+THREAD_FUNC(loggerFlusher);
 
 void loggerInit(const char *file)
 {
     if (logFile != NULL) return;
+    if (logConsole == NULL) logConsole = stdout;
 
     logFile = fopen(file, "w+");
     if (logFile == NULL) {
@@ -141,6 +510,15 @@ void loggerInit(const char *file)
         exit(EXIT_FAILURE);
     }
 
+    for (uint64_t i = 0; i < LOG_RING_SLOTS; i++) {
+        logRing.slots[i].sequence = i;
+    }
+
+    mutexInit(&logRing.lock);
+    condInit(&logRing.wake);
+    /* without a flusher, messages are just written out synchronously */
+    logRing.running = threadCreate(&logRing.flusher, loggerFlusher, NULL);
+
     time_t t = time(NULL);
     struct tm *tm = localtime(&t);
     char localTime[KB];
@@ -149,22 +527,30 @@ void loggerInit(const char *file)
         strncpy(localTime, "unable to retrieve local date and time", KB);
     }
 
+    statsInit();
     loggerAppend(LOG_INIT, "WAVE generator initialized (%s)", localTime);
 }
 
 void loggerClose(int32_t code)
 {
-    char *text = readFileContents(LOG_FILE_NAME, logFile);
+    statsReport();
     const char *status = code ? "abnormally" : "normally";
     loggerAppend(LOG_EXIT,
         "generator terminated %s with exit code %d", status, code);
-    fclose(logFile);
-    if (text == NULL) {
-        remove(LOG_FILE_NAME);
-        return;
+    if (logRing.running) {
+        mutexLock(&logRing.lock);
+        __atomic_store_n(&logRing.quit, true, __ATOMIC_SEQ_CST);
+        condBroadcast(&logRing.wake);
+        mutexUnlock(&logRing.lock);
+        threadJoin(logRing.flusher);
+        logRing.running = false;
     }
 
-    free(text);
+    mutexDestroy(&logRing.lock);
+    condDestroy(&logRing.wake);
+    fclose(logFile);
+    logFile = NULL;
+    if (logBytes == 0) remove(LOG_FILE_NAME);
 }
 
 #define VT_COLOR_CLEAR  "\x1B[0m"
@@ -173,7 +559,8 @@ void loggerClose(int32_t code)
 #define VT_COLOR_YELLOW "\x1B[93m"
 #define VT_COLOR_BLUE   "\x1B[94m"
 
-void loggerAppend(LogState state, const char *restrict fmt, ...)
+/* writes a formatted message to the log file and the console */
+void loggerWrite(LogState state, const char *text)
 {
     const char *logState = NULL;
     switch (state) {
@@ -200,26 +587,195 @@ void loggerAppend(LogState state, const char *restrict fmt, ...)
     } break;
     }
 
-    char format[2 * KB] = {0};
-    snprintf(format, sizeof(format), "[%s]: %s\n", logState, fmt);
-    fmt = format;
-    va_list args;
-    va_start(args, fmt);
-    if (vfprintf(logFile, fmt, args) <= 0) {
+    if (logFile == NULL) return;
+
+    int written = fprintf(logFile, "[%s]: %s\n", logState, text);
+    if (written <= 0) {
         fprintf(stderr,
             "unable to write log message to file: %s\n", strerror(errno));
-    } 
-    
-    va_end(args);
-    va_start(args, fmt);
-    if (vprintf(fmt, args) <= 0) {
+    } else {
+        logBytes += (size_t)written;
+    }
+
+    if (fprintf(logConsole, "[%s]: %s\n", logState, text) <= 0) {
         fprintf(stderr,
-            "unable to write log message to stdout: %s\n", strerror(errno));
+            "unable to write log message to console: %s\n", strerror(errno));
+    }
+}
+
+/* notes how many messages were lost since the last time it was called */
+void loggerDropped(void)
+{
+    uint64_t dropped = __atomic_exchange_n(&logRing.dropped, 0,
+        __ATOMIC_RELAXED);
+    if (dropped > 0) {
+        char text[KB];
+        snprintf(text, sizeof(text), "%llu message(s) dropped (the log"
+            " couldn't keep up)", (unsigned long long)dropped);
+        loggerWrite(LOG_INFO, text);
+    }
+}
+
+/* writes out every message enqueued so far, returning whether there was any */
+bool loggerDrain(void)
+{
+    bool any = false;
+    for (;;) {
+        LogSlot *slot = &logRing.slots[logRing.tail & (LOG_RING_SLOTS - 1)];
+        uint64_t seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if (seq != logRing.tail + 1) break;
+
+        loggerDropped();
+        loggerWrite(slot->state, slot->text);
+        __atomic_store_n(&slot->sequence, logRing.tail + LOG_RING_SLOTS,
+            __ATOMIC_RELEASE);
+        __atomic_store_n(&logRing.tail, logRing.tail + 1, __ATOMIC_RELEASE);
+        any = true;
+    }
+
+    loggerDropped();
+
+    /* the console is what shows progress, the file can wait for the end */
+    if (any) fflush(logConsole);
+
+    return any;
+}
+
+THREAD_FUNC(loggerFlusher)
+{
+    (void)arg;
+    for (;;) {
+        if (loggerDrain()) continue;
+
+        /* 'sleeping' is raised before the ring is checked one last time, so
+           a producer either sees it (and wakes us up) or its message gets
+           drained right here */
+        mutexLock(&logRing.lock);
+        __atomic_store_n(&logRing.sleeping, true, __ATOMIC_SEQ_CST);
+        bool quit = __atomic_load_n(&logRing.quit, __ATOMIC_SEQ_CST);
+        LogSlot *slot = &logRing.slots[logRing.tail & (LOG_RING_SLOTS - 1)];
+        bool pending = __atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST) ==
+            logRing.tail + 1;
+        if (!pending && !quit) condWait(&logRing.wake, &logRing.lock);
+
+        __atomic_store_n(&logRing.sleeping, false, __ATOMIC_SEQ_CST);
+        mutexUnlock(&logRing.lock);
+        if (quit && !pending) break;
+    }
+
+    loggerDrain();
+    fflush(logFile);
+    return 0;
+}
+
+/* claims a free slot of the ring, or returns NULL when it's full */
+LogSlot *loggerClaim(void)
+{
+    uint64_t pos = __atomic_load_n(&logRing.head, __ATOMIC_RELAXED);
+    for (;;) {
+        LogSlot *slot = &logRing.slots[pos & (LOG_RING_SLOTS - 1)];
+        uint64_t seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff < 0) return NULL;
+
+        if (diff == 0) {
+            /* a failed exchange reloads 'pos' with the current head */
+            if (__atomic_compare_exchange_n(&logRing.head, &pos, pos + 1,
+                true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                return slot;
+            }
+        } else {
+            pos = __atomic_load_n(&logRing.head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* enqueues a message without waiting for it to be written, except that
+   errors (unlike informational messages, which get dropped) wait for room
+   when the ring is full, and fatal ones wait to be written out (the process
+   is about to exit, possibly without closing the logger) */
+void loggerAppend(LogState state, const char *restrict fmt, ...)
+{
+    if (state == LOG_INFO && logQuiet) return;
+
+    va_list args;
+    va_start(args, fmt);
+    if (logScope.issues != NULL && state != LOG_INFO) {
+        char text[LOG_MESSAGE_MAX];
+        vsnprintf(text, sizeof(text), fmt, args);
+        va_end(args);
+
+        size_t used = strlen(logScope.issues);
+        if (used + 1 < logScope.size) {
+            snprintf(logScope.issues + used, logScope.size - used, "%s%s",
+                used > 0 ? "; " : "", text);
+        }
+
+        LogScope scope = logScope;
+        logScope.issues = NULL;
+        if (scope.name != NULL) {
+            loggerAppend(state, "'%s': %s", scope.name, text);
+        } else {
+            loggerAppend(state, "%s", text);
+        }
+
+        logScope = scope;
+        return;
+    }
+
+    if (!logRing.running) {
+        char text[LOG_MESSAGE_MAX];
+        vsnprintf(text, sizeof(text), fmt, args);
+        va_end(args);
+        loggerWrite(state, text);
+        return;
+    }
+
+    LogSlot *slot = loggerClaim();
+    while (slot == NULL && state != LOG_INFO) {
+        threadYield();
+        slot = loggerClaim();
+    }
+
+    if (slot == NULL) {
+        __atomic_add_fetch(&logRing.dropped, 1, __ATOMIC_RELAXED);
+        va_end(args);
+        return;
     }
-    
+
+    slot->state = state;
+    vsnprintf(slot->text, sizeof(slot->text), fmt, args);
     va_end(args);
+
+    /* the claimed position is what the slot's sequence was set to */
+    uint64_t pos = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&logRing.sleeping, __ATOMIC_SEQ_CST)) {
+        mutexLock(&logRing.lock);
+        condBroadcast(&logRing.wake);
+        mutexUnlock(&logRing.lock);
+    }
+
+    while (state == ERR_FATAL &&
+        __atomic_load_n(&logRing.tail, __ATOMIC_ACQUIRE) <= pos) {
+        threadYield();
+    }
 }
 
+size_t waveSampleCount(const Parameters *p);
+
+#define RIFF_SIZE_MAX 0xFFFFFFFFu
+#define RIFF_HEADER_SIZE 44
+#define DS64_CHUNK_SIZE 36
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+#define FMT_EXTENSIBLE_SIZE 40
+
+/* speaker positions for 1 to 8 channels: mono, stereo, 3.0, quad, 5.0, 5.1,
+   6.1 and 7.1 (the same layouts Windows picks for those counts) */
+static const uint32_t defaultChannelMasks[MAX_CHANNELS + 1] = {
+    0x0, 0x4, 0x3, 0x7, 0x33, 0x37, 0x3F, 0x13F, 0x63F
+};
+
 WavHeader wavHeaderBuild(const Parameters *p)
 {
     WavHeader h = {
@@ -228,24 +784,114 @@ WavHeader wavHeaderBuild(const Parameters *p)
         .subChunk1ID = "fmt ",
         .subChunk1Size = 16,
         .audioFormat = p->sampleFormat,
-        .numChannels = 1,
+        .numChannels = p->channelCount,
         .sampleRate = p->sampleRate,
         .bitsPerSample = p->bitsPerSample,
         .subChunk2ID = "data",
     };
 
+    /* mono files keep the plain format chunk every reader understands */
+    if (h.numChannels > 1) {
+        h.subChunk1Size = FMT_EXTENSIBLE_SIZE;
+        h.audioFormat = WAVE_FORMAT_EXTENSIBLE;
+        h.extensionSize = 22;
+        h.validBitsPerSample = h.bitsPerSample;
+        h.channelMask = p->channelMask ? p->channelMask :
+            defaultChannelMasks[h.numChannels];
+        h.subFormat = p->sampleFormat;
+    }
+
     h.blockAlign = h.numChannels * h.bitsPerSample / 8;
     h.byteRate = h.sampleRate * h.blockAlign;
-    h.subChunk2Size = p->sampleRate * p->durationSecs * h.blockAlign;
-    h.chunkSize = 36 + h.subChunk2Size;
+    h.sampleCount = waveSampleCount(p);
+    h.dataSize = h.sampleCount * h.blockAlign;
+    h.riffSize = 4 + (8 + h.subChunk1Size) + 8 + h.dataSize;
+    if (h.riffSize <= RIFF_SIZE_MAX) {
+        h.chunkSize = (uint32_t)h.riffSize;
+        h.subChunk2Size = (uint32_t)h.dataSize;
+        return h;
+    }
+
+    /* too big for 32-bit chunk sizes: the real ones go in the ds64 chunk
+       and the RIFF ones are set to -1 as RF64 (and BW64) readers expect */
+    memcpy(h.chunkID, "RF64", 4);
+    h.riffSize += DS64_CHUNK_SIZE;
+    h.chunkSize = RIFF_SIZE_MAX;
+    h.subChunk2Size = RIFF_SIZE_MAX;
+    loggerAppend(LOG_INFO,
+        "wave data exceeds the 4GiB RIFF limit, writing an RF64 file");
 
     return h;
 }
 
+static uint8_t *putLittleEndian(uint8_t *dst, uint64_t value, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; i++) {
+        dst[i] = (uint8_t)(value >> (8 * i));
+    }
+
+    return dst + bytes;
+}
+
+static uint8_t *putChunkID(uint8_t *dst, const char *id)
+{
+    memcpy(dst, id, 4);
+    return dst + 4;
+}
+
+/* writes the header as little-endian bytes (whatever the host byte order
+   is) into dst, which must hold WAV_HEADER_MAX bytes, returning its size */
+size_t wavHeaderSerialize(const WavHeader *h, uint8_t *dst)
+{
+    uint8_t *d = dst;
+    d = putChunkID(d, h->chunkID);
+    d = putLittleEndian(d, h->chunkSize, 4);
+    d = putChunkID(d, h->format);
+    if (memcmp(h->chunkID, "RF64", 4) == 0) {
+        d = putChunkID(d, "ds64");
+        d = putLittleEndian(d, DS64_CHUNK_SIZE - 8, 4);
+        d = putLittleEndian(d, h->riffSize, 8);
+        d = putLittleEndian(d, h->dataSize, 8);
+        d = putLittleEndian(d, h->sampleCount, 8);
+        d = putLittleEndian(d, 0, 4); // no extra chunk sizes in the table
+    }
+
+    d = putChunkID(d, h->subChunk1ID);
+    d = putLittleEndian(d, h->subChunk1Size, 4);
+    d = putLittleEndian(d, h->audioFormat, 2);
+    d = putLittleEndian(d, h->numChannels, 2);
+    d = putLittleEndian(d, h->sampleRate, 4);
+    d = putLittleEndian(d, h->byteRate, 4);
+    d = putLittleEndian(d, h->blockAlign, 2);
+    d = putLittleEndian(d, h->bitsPerSample, 2);
+    if (h->audioFormat == WAVE_FORMAT_EXTENSIBLE) {
+        /* the sub-format GUID is the format code followed by the fixed
+           KSDATAFORMAT_SUBTYPE suffix */
+        static const uint8_t guidSuffix[14] = {
+            0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80,
+            0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71
+        };
+
+        d = putLittleEndian(d, h->extensionSize, 2);
+        d = putLittleEndian(d, h->validBitsPerSample, 2);
+        d = putLittleEndian(d, h->channelMask, 4);
+        d = putLittleEndian(d, h->subFormat, 2);
+        memcpy(d, guidSuffix, sizeof(guidSuffix));
+        d += sizeof(guidSuffix);
+    }
+
+    d = putChunkID(d, h->subChunk2ID);
+    d = putLittleEndian(d, h->subChunk2Size, 4);
+
+    return (size_t)(d - dst);
+}
+
 #define PI 3.14159265358979323846
 #define LINE_DELIMS "\r\n"
 #define MAX_AMP_DB 6.0
 #define OUT_FILE_NAME "file.wav"
+#define CHUNK_CACHE_LIMIT (512ull * KB * KB) // default, in bytes
+#define CHUNK_CACHE_NAME_MAX 32 // '/<key>.chunk', or the name it's written as
 
 #define ERR_OUT_OF_MEMORY() loggerAppend(ERR_FATAL, \
     "failed to allocate more memory: %s\n", strerror(errno))
@@ -266,82 +912,220 @@ typedef enum ConfigLine {
     LINE_SAMPLE_FORMAT,
     LINE_APPLY_DITHER,
     LINE_OUTPUT_FILE,
+    LINE_OSCILLATOR,
+    LINE_SYNTHESIS,
+    LINE_RENDER_MODE,
+    LINE_PEAK_MODE,
+    LINE_SAMPLE_PRECISION,
+    LINE_THREAD_COUNT,
+    LINE_DITHER_SEED,
+    LINE_OUTPUT_BACKEND,
+    LINE_CHANNEL_COUNT,
+    LINE_CHANNEL_MASK,
+    LINE_SWEEP,
+    LINE_SWEEP_FREQUENCIES,
+    LINE_NOISE_SEED,
+    LINE_NOISE_BAND,
+    LINE_CHUNK_CACHE,
+    LINE_CHUNK_CACHE_LIMIT,
     LINE_COUNT
 } ConfigLine;
 
+/* per-channel keys, written as 'Channel<N>.<Key>' with N starting at 1 */
+typedef enum ChannelLine {
+    CHANNEL_TONE_FREQUENCIES,
+    CHANNEL_WAVE_TYPE,
+    CHANNEL_AMPLITUDE,
+    CHANNEL_LINE_COUNT
+} ChannelLine;
+
+static const char *configKeys[LINE_COUNT] = {
+    [LINE_TONE_FREQUENCIES] = "ToneFrequencies",
+    [LINE_WAVE_TYPE] = "WaveType",
+    [LINE_DURATION_SECONDS] = "DurationSeconds",
+    [LINE_AMPLITUDE] = "Amplitude",
+    [LINE_SAMPLE_RATE] = "SampleRate",
+    [LINE_BITS_PER_SAMPLE] = "BitsPerSample",
+    [LINE_SAMPLE_FORMAT] = "SampleFormat",
+    [LINE_APPLY_DITHER] = "ApplyDither",
+    [LINE_OUTPUT_FILE] = "OutputFile",
+    [LINE_OSCILLATOR] = "Oscillator",
+    [LINE_SYNTHESIS] = "Synthesis",
+    [LINE_RENDER_MODE] = "RenderMode",
+    [LINE_PEAK_MODE] = "PeakMode",
+    [LINE_SAMPLE_PRECISION] = "SamplePrecision",
+    [LINE_THREAD_COUNT] = "ThreadCount",
+    [LINE_DITHER_SEED] = "DitherSeed",
+    [LINE_OUTPUT_BACKEND] = "OutputBackend",
+    [LINE_CHANNEL_COUNT] = "ChannelCount",
+    [LINE_CHANNEL_MASK] = "ChannelMask",
+    [LINE_SWEEP] = "Sweep",
+    [LINE_SWEEP_FREQUENCIES] = "SweepFrequencies",
+    [LINE_NOISE_SEED] = "NoiseSeed",
+    [LINE_NOISE_BAND] = "NoiseBand",
+    [LINE_CHUNK_CACHE] = "ChunkCache",
+    [LINE_CHUNK_CACHE_LIMIT] = "ChunkCacheLimit",
+};
+
+static const char *channelKeys[CHANNEL_LINE_COUNT] = {
+    [CHANNEL_TONE_FREQUENCIES] = "ToneFrequencies",
+    [CHANNEL_WAVE_TYPE] = "WaveType",
+    [CHANNEL_AMPLITUDE] = "Amplitude",
+};
+
+/* the (unparsed) value given to every key, where later sources override
+   earlier ones (like a batch job's keys do with the config file's) */
+typedef struct ConfigLines {
+    char *lines[LINE_COUNT];
+    char *channelLines[MAX_CHANNELS][CHANNEL_LINE_COUNT];
+} ConfigLines;
+
 double parseDouble(const char *line);
 double *parseFreqList(char *line, size_t *listLen);
 uint32_t parseUnsignedInt(const char *line);
 WaveType parseWaveType(char *restrict line);
 SampleFormat parseSampleFormat(char *restrict line);
+OscillatorMode parseOscillatorMode(char *restrict line);
+SynthesisMode parseSynthesisMode(char *restrict line);
+RenderMode parseRenderMode(char *restrict line);
+PeakMode parsePeakMode(char *restrict line);
+SamplePrecision parseSamplePrecision(char *restrict line);
+SweepMode parseSweepMode(char *restrict line);
+OutputBackend parseOutputBackend(char *restrict line);
 bool parseBool(const char *line);
+bool parseChannelKey(const char *key, size_t *channel, size_t *line);
+void channelsResolve(Parameters *p,
+    char *const lines[MAX_CHANNELS][CHANNEL_LINE_COUNT]);
+void configCollect(const char *name, char *text, ConfigLines *config);
+Parameters configApply(const ConfigLines *config);
+char *configLineDup(const char *line);
 int isDoubleQuote(int c);
 void stripChars(char *restrict string, int (*isChar)(int));
 const char *waveTypeToString(WaveType type);
+bool waveIsNoise(WaveType type);
 const char *sampleFormatToString(SampleFormat fmt);
+const char *oscillatorModeToString(OscillatorMode mode);
+const char *synthesisModeToString(SynthesisMode mode);
+const char *renderModeToString(RenderMode mode);
+const char *peakModeToString(PeakMode mode);
+const char *samplePrecisionToString(SamplePrecision precision);
+const char *sweepModeToString(SweepMode mode);
+const char *outputBackendToString(OutputBackend backend);
 
 Parameters parametersParse(const char *file)
 {
-    Parameters params = { // default values
-        .freqs = malloc(sizeof(*params.freqs)),
-        .freqCount = 1,
-        .waveType = WAVE_SINE,
-        .durationSecs = 4.0,
-        .amplitude = -1.0,
-        .sampleRate = 48000,
-        .bitsPerSample = 24,
-        .sampleFormat = FMT_INT_PCM,
-        .applyDither = true,
-        .outputFile = strdup(OUT_FILE_NAME)
-    };
-
-    if (params.freqs == NULL) {
-        ERR_OUT_OF_MEMORY();
-        exit(EXIT_FAILURE);
-    }
-
-    *params.freqs = 440.0;
-
+    ConfigLines config = {0};
     FILE *f = fopen(file, "r");
     if (f == NULL) {
         loggerAppend(ERR_READ, "unable to read config file '%s': %s",
             file, strerror(errno));
+        Parameters params = configApply(&config);
         logWaveProperties(&params);
         return params;
     }
 
     char *fileBuf = readFileContents(file, f);
     fclose(f);
-    if (fileBuf == NULL) return params;
+    if (fileBuf == NULL) return configApply(&config);
+
+    configCollect(file, fileBuf, &config);
+    Parameters params = configApply(&config);
+    free(fileBuf);
+
+    return params;
+}
 
-    char *lines[LINE_COUNT] = {0};
+/* records the value of every 'Key = Value' line in 'text' (which is modified
+   in place and must outlive 'config'), where 'name' is only used for logging */
+void configCollect(const char *name, char *text, ConfigLines *config)
+{
     char *parserState = NULL;
-    char *tok = strtok_r(fileBuf, LINE_DELIMS, &parserState);
-    for (int i = 0; i < LINE_COUNT; i++) {
-        lines[i] = tok;
+    char *tok = strtok_r(text, LINE_DELIMS, &parserState);
+    while (tok != NULL) {
+        char *key = tok;
         tok = strtok_r(NULL, LINE_DELIMS, &parserState);
-    }
 
-    for (size_t i = 0; i < LINE_COUNT; i++) {
-        char *line = strtok(lines[i], ";");
-        bool lineOk = false;
-        while (*line != 0) {
-            if (*line == '=') {
-                lineOk = true;
-                line += 1;
-                break;
+        char *comment = strchr(key, ';');
+        if (comment != NULL) *comment = '\0';
+
+        char *value = strchr(key, '=');
+        if (value == NULL) {
+            stripChars(key, isspace);
+            if (*key != '\0') {
+                loggerAppend(ERR_PARSE,
+                    "'%s': unable to parse line '%s': incorrect formatting",
+                    name, key);
             }
 
-            line += 1;
+            continue;
+        }
+
+        *value++ = '\0';
+        stripChars(key, isspace);
+        size_t i = 0, channel = 0;
+        while (i < LINE_COUNT && strcmp(key, configKeys[i]) != 0) i++;
+        if (i == LINE_COUNT && parseChannelKey(key, &channel, &i)) {
+            config->channelLines[channel][i] = value;
+            continue;
         }
 
-        if (!lineOk) {
+        if (i == LINE_COUNT) {
             loggerAppend(ERR_PARSE,
-                "'%s': unable to parse line %zu: incorrect formatting",
-                file, i + 1);
+                "'%s': unrecognized key '%s' (ignoring)", name, key);
             continue;
         }
 
+        config->lines[i] = value;
+    }
+}
+
+/* builds the parameters out of the defaults and the collected values (which
+   are left untouched, so they can be applied again) */
+Parameters configApply(const ConfigLines *config)
+{
+    Parameters params = { // default values
+        .freqs = malloc(sizeof(*params.freqs)),
+        .freqCount = 1,
+        .waveType = WAVE_SINE,
+        .durationSecs = 4.0,
+        .amplitude = -1.0,
+        .sampleRate = 48000,
+        .bitsPerSample = 24,
+        .sampleFormat = FMT_INT_PCM,
+        .applyDither = true,
+        .ditherSeed = 0,
+        .outputFile = strdup(OUT_FILE_NAME),
+        .oscillator = OSC_RECURRENCE,
+        .synthesis = SYNTH_WAVETABLE,
+        .renderMode = RENDER_CHUNK,
+        .peakMode = PEAK_AUTO,
+        .precision = PRECISION_FLOAT,
+        .sweep = SWEEP_NONE,
+        .sweepFreqs = {20.0, 20000.0},
+        .noiseSeed = 0,
+        .noiseBand = {20.0, 20000.0},
+        .cacheDir = NULL,
+        .cacheLimit = CHUNK_CACHE_LIMIT,
+        .threadCount = 0,
+        .outputBackend = OUT_AUTO,
+        .outputFd = -1,
+        .channelCount = 1,
+        .channelMask = 0
+    };
+
+    if (params.freqs == NULL) {
+        ERR_OUT_OF_MEMORY();
+        exit(EXIT_FAILURE);
+    }
+
+    *params.freqs = 440.0;
+
+    /* values are applied in the order of the ConfigLine enum, since some of
+       them are validated against others */
+    for (size_t i = 0; i < LINE_COUNT; i++) {
+        if (config->lines[i] == NULL) continue;
+
+        char *line = configLineDup(config->lines[i]);
         stripChars(line, isspace);
         switch (i) {
         case LINE_TONE_FREQUENCIES: {
@@ -433,7 +1217,7 @@ Parameters parametersParse(const char *file)
         } break;
         case LINE_OUTPUT_FILE: {
             stripChars(line, isDoubleQuote);
-            int len = snprintf(NULL, 0, "%s.wav", line);
+            int len = snprintf(NULL, 0, "%s.wav", line) + 1;
             char *fileName = malloc(len * sizeof(*fileName));
             if (fileName == NULL) {
                 ERR_OUT_OF_MEMORY();
@@ -451,44 +1235,422 @@ Parameters parametersParse(const char *file)
                 params.outputFile = fileName;
             }
         } break;
-        }
-    }
-
-    if (fileBuf != NULL) free(fileBuf);
+        case LINE_OSCILLATOR: {
+            int32_t oscillator = parseOscillatorMode(line);
+            if (errno == 0) params.oscillator = oscillator;
+        } break;
+        case LINE_SYNTHESIS: {
+            int32_t synthesis = parseSynthesisMode(line);
+            if (errno == 0) params.synthesis = synthesis;
+        } break;
+        case LINE_RENDER_MODE: {
+            int32_t renderMode = parseRenderMode(line);
+            if (errno == 0) params.renderMode = renderMode;
+        } break;
+        case LINE_PEAK_MODE: {
+            int32_t peakMode = parsePeakMode(line);
+            if (errno == 0) params.peakMode = peakMode;
+        } break;
+        case LINE_SAMPLE_PRECISION: {
+            int32_t precision = parseSamplePrecision(line);
+            if (errno == 0) params.precision = precision;
+        } break;
+        case LINE_THREAD_COUNT: {
+            /* zero is a valid count here (it means one thread per core),
+               but strtoul would wrap a negative one around */
+            errno = 0;
+            char *end = NULL;
+            unsigned long threadCount = strtoul(line, &end, 10);
+            if (errno != 0 || end == line || *end != '\0' || *line == '-' ||
+                threadCount > UINT32_MAX) {
+                loggerAppend(ERR_PARSE,
+                    "unable to parse a thread count from '%s'", line);
+            } else {
+                params.threadCount = (uint32_t)threadCount;
+            }
+        } break;
+        case LINE_DITHER_SEED: {
+            errno = 0;
+            char *end = NULL;
+            unsigned long long seed = strtoull(line, &end, 0);
+            if (errno != 0 || end == line || *end != '\0' || *line == '-') {
+                loggerAppend(ERR_PARSE,
+                    "unable to parse a dither seed from '%s'", line);
+            } else {
+                params.ditherSeed = (uint64_t)seed;
+            }
+        } break;
+        case LINE_OUTPUT_BACKEND: {
+            int32_t backend = parseOutputBackend(line);
+            if (errno == 0) params.outputBackend = backend;
+        } break;
+        case LINE_CHANNEL_COUNT: {
+            uint32_t channelCount = parseUnsignedInt(line);
+            if (errno != 0) break;
+            if (channelCount < 1 || channelCount > MAX_CHANNELS) {
+                loggerAppend(ERR_ARG, "channel count must be between 1 and %d"
+                    " (ignoring)", MAX_CHANNELS);
+                break;
+            }
 
-    return params;
-}
+            params.channelCount = channelCount;
+        } break;
+        case LINE_CHANNEL_MASK: {
+            errno = 0;
+            char *end = NULL;
+            unsigned long mask = strtoul(line, &end, 0);
+            if (errno != 0 || end == line || *end != '\0' ||
+                mask > UINT32_MAX) {
+                loggerAppend(ERR_PARSE,
+                    "unable to parse a channel mask from '%s'", line);
+            } else {
+                params.channelMask = (uint32_t)mask;
+            }
+        } break;
+        case LINE_SWEEP: {
+            int32_t sweep = parseSweepMode(line);
+            if (errno == 0) params.sweep = sweep;
+        } break;
+        case LINE_SWEEP_FREQUENCIES: {
+            size_t listLen = 0;
+            double *freqs = parseFreqList(line, &listLen);
+            if (freqs == NULL) break;
 
-void logWaveProperties(const Parameters *p)
-{
-    char toneList[4 * KB] = {0};
-    for (size_t i = 0; i < p->freqCount && p->freqs; i++) {
-        char num[32] = {0};
-        snprintf(num, sizeof(num), "%.1lfHz, ", p->freqs[i]);
-        strncat(toneList, num, sizeof(toneList) - 1);
-    }
+            if (listLen != 2) {
+                loggerAppend(ERR_ARG, "a sweep takes a start and an end"
+                    " frequency (ignoring)");
+            } else if (freqs[0] * 2.0 >= params.sampleRate ||
+                freqs[1] * 2.0 >= params.sampleRate) {
+                loggerAppend(ERR_ARG, "sweep frequencies must be below"
+                    " %.1lfHz (ignoring)", params.sampleRate / 2.0);
+            } else {
+                params.sweepFreqs[0] = freqs[0];
+                params.sweepFreqs[1] = freqs[1];
+            }
 
-    toneList[strlen(toneList) - 2] = '\0';
+            free(freqs);
+        } break;
+        case LINE_NOISE_SEED: {
+            errno = 0;
+            char *end = NULL;
+            unsigned long long seed = strtoull(line, &end, 0);
+            if (errno != 0 || end == line || *end != '\0' || *line == '-') {
+                loggerAppend(ERR_PARSE,
+                    "unable to parse a noise seed from '%s'", line);
+            } else {
+                params.noiseSeed = (uint64_t)seed;
+            }
+        } break;
+        case LINE_NOISE_BAND: {
+            size_t listLen = 0;
+            double *freqs = parseFreqList(line, &listLen);
+            if (freqs == NULL) break;
+
+            if (listLen != 2 || freqs[0] >= freqs[1]) {
+                loggerAppend(ERR_ARG, "a noise band takes a lower and a"
+                    " higher frequency (ignoring)");
+            } else if (freqs[0] * 2.0 >= params.sampleRate) {
+                loggerAppend(ERR_ARG, "the noise band must start below"
+                    " %.1lfHz (ignoring)", params.sampleRate / 2.0);
+            } else {
+                params.noiseBand[0] = freqs[0];
+                params.noiseBand[1] = freqs[1];
+            }
+
+            free(freqs);
+        } break;
+        case LINE_CHUNK_CACHE: {
+            stripChars(line, isDoubleQuote);
+            if (strlen(line) + CHUNK_CACHE_NAME_MAX >= NAME_MAX) {
+                loggerAppend(ERR_ARG, "chunk cache directory is longer than"
+                    " %d bytes (ignoring)", NAME_MAX - CHUNK_CACHE_NAME_MAX);
+                break;
+            }
+
+            free(params.cacheDir);
+            params.cacheDir = *line != '\0' ? strdup(line) : NULL;
+            if (*line != '\0' && params.cacheDir == NULL) {
+                ERR_OUT_OF_MEMORY();
+                exit(EXIT_FAILURE);
+            }
+        } break;
+        case LINE_CHUNK_CACHE_LIMIT: {
+            errno = 0;
+            char *end = NULL;
+            unsigned long long limit = strtoull(line, &end, 0);
+            if (errno != 0 || end == line || *end != '\0' ||
+                limit > UINT64_MAX / KB / KB) {
+                loggerAppend(ERR_PARSE,
+                    "unable to parse a chunk cache limit from '%s'", line);
+            } else {
+                params.cacheLimit = (uint64_t)limit * KB * KB;
+            }
+        } break;
+        }
+
+        free(line);
+    }
+
+    /* the default range may not fit the sample rate that was given */
+    if (params.sweep != SWEEP_NONE &&
+        (params.sweepFreqs[0] * 2.0 >= params.sampleRate ||
+        params.sweepFreqs[1] * 2.0 >= params.sampleRate)) {
+        loggerAppend(ERR_ARG, "sweep frequencies must be below %.1lfHz"
+            " (not sweeping)", params.sampleRate / 2.0);
+        params.sweep = SWEEP_NONE;
+    }
+
+    /* which is just a steady tone, and one with no log-frequency rate */
+    if (params.sweep == SWEEP_EXPONENTIAL &&
+        params.sweepFreqs[0] == params.sweepFreqs[1]) {
+        params.sweep = SWEEP_LINEAR;
+    }
+
+    channelsResolve(&params, config->channelLines);
+
+    return params;
+}
+
+/* parsing happens on a copy, since it strips and splits the values */
+char *configLineDup(const char *line)
+{
+    char *dup = strdup(line);
+    if (dup == NULL) {
+        ERR_OUT_OF_MEMORY();
+        exit(EXIT_FAILURE);
+    }
+
+    return dup;
+}
+
+/* matches keys like 'Channel2.WaveType', returning the (zero-based) channel
+   and the ChannelLine they refer to */
+bool parseChannelKey(const char *key, size_t *channel, size_t *line)
+{
+    const char *prefix = "Channel";
+    if (strncmp(key, prefix, strlen(prefix)) != 0) return false;
+
+    char *end = NULL;
+    const char *num = key + strlen(prefix);
+    unsigned long n = strtoul(num, &end, 10);
+    if (end == num || *end != '.' || n < 1 || n > MAX_CHANNELS) return false;
+
+    for (size_t i = 0; i < CHANNEL_LINE_COUNT; i++) {
+        if (strcmp(end + 1, channelKeys[i]) == 0) {
+            *channel = n - 1, *line = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* every channel starts off with the global tone set and then takes whatever
+   its own keys override */
+void channelsResolve(Parameters *p,
+    char *const lines[MAX_CHANNELS][CHANNEL_LINE_COUNT])
+{
+    for (size_t c = 0; c < MAX_CHANNELS; c++) {
+        Channel *ch = &p->channels[c];
+        if (c >= p->channelCount) {
+            for (size_t i = 0; i < CHANNEL_LINE_COUNT; i++) {
+                if (lines[c][i] == NULL) continue;
+
+                loggerAppend(ERR_ARG, "'Channel%zu.%s' is beyond the channel"
+                    " count (ignoring)", c + 1, channelKeys[i]);
+            }
+
+            continue;
+        }
+
+        ch->freqs = malloc(p->freqCount * sizeof(*ch->freqs));
+        if (ch->freqs == NULL) {
+            ERR_OUT_OF_MEMORY();
+            exit(EXIT_FAILURE);
+        }
+
+        memcpy(ch->freqs, p->freqs, p->freqCount * sizeof(*ch->freqs));
+        ch->freqCount = p->freqCount;
+        ch->waveType = p->waveType;
+        ch->amplitude = p->amplitude;
+        ch->index = (uint32_t)c;
+        for (size_t i = 0; i < CHANNEL_LINE_COUNT; i++) {
+            if (lines[c][i] == NULL) continue;
+
+            char *line = configLineDup(lines[c][i]);
+            stripChars(line, isspace);
+            switch (i) {
+            case CHANNEL_TONE_FREQUENCIES: {
+                size_t listLen = 0;
+                double *freqs = parseFreqList(line, &listLen);
+                if (freqs == NULL) break;
+
+                bool belowNyquist = true;
+                for (size_t j = 0; j < listLen; j++) {
+                    belowNyquist &= freqs[j] * 2.0 < p->sampleRate;
+                }
+
+                if (!belowNyquist) {
+                    loggerAppend(ERR_ARG, "channel %zu: frequencies must be"
+                        " below %.1lfHz (ignoring)", c + 1,
+                        p->sampleRate / 2.0);
+                    free(freqs);
+                    break;
+                }
+
+                free(ch->freqs);
+                ch->freqs = freqs, ch->freqCount = listLen;
+            } break;
+            case CHANNEL_WAVE_TYPE: {
+                int32_t waveType = parseWaveType(line);
+                if (errno == 0) ch->waveType = waveType;
+            } break;
+            case CHANNEL_AMPLITUDE: {
+                double amplitude = parseDouble(line);
+                if (errno == 0) {
+                    ch->amplitude =
+                        amplitude < MAX_AMP_DB ? amplitude : MAX_AMP_DB;
+                }
+            } break;
+            }
+
+            free(line);
+        }
+    }
+}
+
+size_t workerPoolSize(void);
+const char *simdLevelToString(SimdLevel level);
+
+static SimdLevel simdLevel = SIMD_SCALAR;
+
+void formatToneList(char *dst, size_t size, const double *freqs, size_t count)
+{
+    *dst = '\0';
+    for (size_t i = 0; i < count && freqs; i++) {
+        char num[32] = {0};
+        snprintf(num, sizeof(num), "%s%.1lfHz", i ? ", " : "", freqs[i]);
+        strncat(dst, num, size - strlen(dst) - 1);
+    }
+}
+
+void logWaveProperties(const Parameters *p)
+{
+    /* with a single channel, its (possibly overridden) tone set is the one
+       that gets rendered */
+    const Channel *mono = &p->channels[0];
+    char toneList[4 * KB] = {0};
+    formatToneList(toneList, sizeof(toneList), mono->freqs, mono->freqCount);
+
+    /* a sweep takes the place of every channel's tone set */
+    char sweepInfo[128] = {0};
+    snprintf(sweepInfo, sizeof(sweepInfo), "%.1lfHz -> %.1lfHz (%s)",
+        p->sweepFreqs[0], p->sweepFreqs[1], sweepModeToString(p->sweep));
+    bool sweep = p->sweep != SWEEP_NONE;
 
-    const char *type = waveTypeToString(p->waveType);
+    /* noise ignores tones (and sweeps), and only band-limited noise has a
+       band to show */
+    char noiseInfo[128] = {0};
+    snprintf(noiseInfo, sizeof(noiseInfo), "seed %llu",
+        (unsigned long long)p->noiseSeed);
+    char bandInfo[128] = {0};
+    snprintf(bandInfo, sizeof(bandInfo), "%.1lfHz - %.1lfHz, seed %llu",
+        p->noiseBand[0], p->noiseBand[1], (unsigned long long)p->noiseSeed);
+
+    bool allSines = true;
+    for (size_t c = 0; c < p->channelCount; c++) {
+        WaveType t = p->channels[c].waveType;
+        allSines &= t == WAVE_SINE || waveIsNoise(t);
+    }
+
+    const char *type = waveTypeToString(mono->waveType);
     const char *sampleFmt = sampleFormatToString(p->sampleFormat);
+    const char *osc = oscillatorModeToString(p->oscillator);
+    const char *synth = synthesisModeToString(p->synthesis);
+    if (allSines) synth = "(ignored)";
+    if (sweep) synth = "wavetable (always used by sweeps)";
+    const char *render = renderModeToString(p->renderMode);
     const char *dither = p->applyDither ? "Yes" : "No";
     if (p->sampleFormat == FMT_FLOAT_PCM) dither = "(ignored)";
+    char ditherInfo[64] = {0};
+    if (p->applyDither && p->sampleFormat == FMT_INT_PCM) {
+        snprintf(ditherInfo, sizeof(ditherInfo), "Yes (seed %llu)",
+            (unsigned long long)p->ditherSeed);
+        dither = ditherInfo;
+    }
 
     const double mb = (double)(p->sampleRate * p->durationSecs *
-        (p->bitsPerSample / 8.0) + sizeof(WavHeader)) / KB;
+        (p->bitsPerSample / 8.0) * p->channelCount + RIFF_HEADER_SIZE) / KB;
+
+    if (p->channelCount > 1) {
+        loggerAppend(LOG_INFO, "generating a %u-channel wave:",
+            p->channelCount);
+        loggerAppend(LOG_INFO, "* Channel Mask:  0x%X", p->channelMask ?
+            p->channelMask : defaultChannelMasks[p->channelCount]);
+        for (size_t c = 0; c < p->channelCount; c++) {
+            const Channel *ch = &p->channels[c];
+            formatToneList(toneList, sizeof(toneList), ch->freqs,
+                ch->freqCount);
+            const char *info = sweep ? sweepInfo : toneList;
+            if (waveIsNoise(ch->waveType)) info = noiseInfo;
+            if (ch->waveType == WAVE_BAND_NOISE) info = bandInfo;
+            loggerAppend(LOG_INFO, "* Channel %zu:     %s @ %+.2lfdBFS: %s",
+                c + 1, waveTypeToString(ch->waveType), ch->amplitude, info);
+        }
+
+        loggerAppend(LOG_INFO, "* Length:        %.2lfs (%.2lfKB)",
+            p->durationSecs, mb);
+    } else if (waveIsNoise(mono->waveType)) {
+        loggerAppend(LOG_INFO, "generating %s:", type);
+        loggerAppend(LOG_INFO, "* Noise:         %s",
+            mono->waveType == WAVE_BAND_NOISE ? bandInfo : noiseInfo);
+        loggerAppend(LOG_INFO, "* Length:        %.2lfs (%.2lfKB)",
+            p->durationSecs, mb);
+        loggerAppend(LOG_INFO, "* Sample Peak:   %+.2lfdBFS", mono->amplitude);
+    } else if (sweep) {
+        loggerAppend(LOG_INFO, "generating a %s sweep:", type);
+        loggerAppend(LOG_INFO, "* Sweep:         %s", sweepInfo);
+        loggerAppend(LOG_INFO, "* Length:        %.2lfs (%.2lfKB)",
+            p->durationSecs, mb);
+        loggerAppend(LOG_INFO, "* Sample Peak:   %+.2lfdBFS", mono->amplitude);
+    } else {
+        loggerAppend(LOG_INFO,
+            "generating %zu %s wave(s):", mono->freqCount, type);
+        loggerAppend(LOG_INFO, "* Frequencies:   %s", toneList);
+        loggerAppend(LOG_INFO, "* Length:        %.2lfs (%.2lfKB)",
+            p->durationSecs, mb);
+        loggerAppend(LOG_INFO, "* Sample Peak:   %+.2lfdBFS", mono->amplitude);
+    }
 
-    loggerAppend(LOG_INFO,
-        "generating %zu %s wave(s):", p->freqCount, type);
-    loggerAppend(LOG_INFO, "* Frequencies:   %s", toneList);
-    loggerAppend(LOG_INFO, "* Length:        %.2lfs (%.2lfKB)",
-        p->durationSecs, mb);
-    loggerAppend(LOG_INFO, "* Sample Peak:   %+.2lfdBFS", p->amplitude);
     loggerAppend(LOG_INFO, "* Sample Rate:   %uHz", p->sampleRate);
     loggerAppend(LOG_INFO, "* Sample Format: %s", sampleFmt);
     loggerAppend(LOG_INFO, "* Bit Depth:     %u-bit", p->bitsPerSample);
     loggerAppend(LOG_INFO, "* Dither:        %s", dither);
-    loggerAppend(LOG_INFO, "* Output File:   '%s'", p->outputFile);
+    loggerAppend(LOG_INFO, "* Synthesis:     %s", synth);
+    loggerAppend(LOG_INFO, "* Oscillator:    %s", osc);
+    loggerAppend(LOG_INFO, "* Render Mode:   %s", render);
+    loggerAppend(LOG_INFO, "* Peak Search:   %s",
+        peakModeToString(p->peakMode));
+    if (samplePrecision(p) != p->precision) {
+        loggerAppend(LOG_INFO, "* Precision:     %s (needed by the output)",
+            samplePrecisionToString(samplePrecision(p)));
+    } else {
+        loggerAppend(LOG_INFO, "* Precision:     %s",
+            samplePrecisionToString(p->precision));
+    }
+    loggerAppend(LOG_INFO, "* Threads:       %zu", workerPoolSize());
+    loggerAppend(LOG_INFO, "* SIMD:          %s", simdLevelToString(simdLevel));
+    if (p->outputFd == 1) {
+        loggerAppend(LOG_INFO, "* Output File:   (stdout)");
+    } else if (p->outputFd >= 0) {
+        loggerAppend(LOG_INFO, "* Output File:   (fd %d)", p->outputFd);
+    } else {
+        loggerAppend(LOG_INFO, "* Output File:   '%s'", p->outputFile);
+    }
+    if (p->cacheDir != NULL) {
+        loggerAppend(LOG_INFO, "* Chunk Cache:   '%s' (up to %lluMB)",
+            p->cacheDir, (unsigned long long)(p->cacheLimit / KB / KB));
+    }
 }
 
 double parseDouble(const char *line)
@@ -574,29 +1736,126 @@ uint32_t parseUnsignedInt(const char *line)
 
 WaveType parseWaveType(char *restrict line)
 {
+    errno = 0;
     stripChars(line, isDoubleQuote);
     if (strcmp(line, "sine") == 0) return WAVE_SINE;
     if (strcmp(line, "triangle") == 0) return WAVE_TRIANGLE;
     if (strcmp(line, "square") == 0) return WAVE_SQUARE;
     if (strcmp(line, "saw") == 0) return WAVE_SAW;
     if (strcmp(line, "even") == 0) return WAVE_EVEN;
+    if (strcmp(line, "white") == 0) return WAVE_WHITE_NOISE;
+    if (strcmp(line, "pink") == 0) return WAVE_PINK_NOISE;
+    if (strcmp(line, "brown") == 0) return WAVE_BROWN_NOISE;
+    if (strcmp(line, "band") == 0) return WAVE_BAND_NOISE;
 
+    errno = EINVAL;
     loggerAppend(ERR_PARSE, "unrecognized wave type: '%s'", line);
     return -1;
 }
 
 SampleFormat parseSampleFormat(char *restrict line)
 {
+    errno = 0;
     stripChars(line, isDoubleQuote);
     if (strcmp(line, "int") == 0) return FMT_INT_PCM;
     if (strcmp(line, "float") == 0) return FMT_FLOAT_PCM;
 
+    errno = EINVAL;
     loggerAppend(ERR_PARSE, "unrecognized sample format: '%s'", line);
     return -1;
 }
 
+OscillatorMode parseOscillatorMode(char *restrict line)
+{
+    errno = 0;
+    stripChars(line, isDoubleQuote);
+    if (strcmp(line, "recurrence") == 0) return OSC_RECURRENCE;
+    if (strcmp(line, "libm") == 0) return OSC_LIBM;
+
+    errno = EINVAL;
+    loggerAppend(ERR_PARSE, "unrecognized oscillator mode: '%s'", line);
+    return -1;
+}
+
+SynthesisMode parseSynthesisMode(char *restrict line)
+{
+    errno = 0;
+    stripChars(line, isDoubleQuote);
+    if (strcmp(line, "wavetable") == 0) return SYNTH_WAVETABLE;
+    if (strcmp(line, "exact") == 0) return SYNTH_EXACT;
+
+    errno = EINVAL;
+    loggerAppend(ERR_PARSE, "unrecognized synthesis mode: '%s'", line);
+    return -1;
+}
+
+RenderMode parseRenderMode(char *restrict line)
+{
+    errno = 0;
+    stripChars(line, isDoubleQuote);
+    if (strcmp(line, "chunk") == 0) return RENDER_CHUNK;
+    if (strcmp(line, "stream") == 0) return RENDER_STREAM;
+
+    errno = EINVAL;
+    loggerAppend(ERR_PARSE, "unrecognized render mode: '%s'", line);
+    return -1;
+}
+
+PeakMode parsePeakMode(char *restrict line)
+{
+    errno = 0;
+    stripChars(line, isDoubleQuote);
+    if (strcmp(line, "auto") == 0) return PEAK_AUTO;
+    if (strcmp(line, "exact") == 0) return PEAK_EXACT;
+    if (strcmp(line, "analytic") == 0) return PEAK_ANALYTIC;
+
+    errno = EINVAL;
+    loggerAppend(ERR_PARSE, "unrecognized peak mode: '%s'", line);
+    return -1;
+}
+
+SweepMode parseSweepMode(char *restrict line)
+{
+    errno = 0;
+    stripChars(line, isDoubleQuote);
+    if (strcmp(line, "none") == 0) return SWEEP_NONE;
+    if (strcmp(line, "linear") == 0) return SWEEP_LINEAR;
+    if (strcmp(line, "exponential") == 0) return SWEEP_EXPONENTIAL;
+
+    errno = EINVAL;
+    loggerAppend(ERR_PARSE, "unrecognized sweep mode: '%s'", line);
+    return -1;
+}
+
+SamplePrecision parseSamplePrecision(char *restrict line)
+{
+    errno = 0;
+    stripChars(line, isDoubleQuote);
+    if (strcmp(line, "float") == 0) return PRECISION_FLOAT;
+    if (strcmp(line, "double") == 0) return PRECISION_DOUBLE;
+
+    errno = EINVAL;
+    loggerAppend(ERR_PARSE, "unrecognized sample precision: '%s'", line);
+    return -1;
+}
+
+OutputBackend parseOutputBackend(char *restrict line)
+{
+    errno = 0;
+    stripChars(line, isDoubleQuote);
+    if (strcmp(line, "auto") == 0) return OUT_AUTO;
+    if (strcmp(line, "stdio") == 0) return OUT_STDIO;
+    if (strcmp(line, "mmap") == 0) return OUT_MMAP;
+    if (strcmp(line, "uring") == 0) return OUT_URING;
+
+    errno = EINVAL;
+    loggerAppend(ERR_PARSE, "unrecognized output backend: '%s'", line);
+    return -1;
+}
+
 bool parseBool(const char *line)
 {
+    errno = 0;
     if (strcmp(line, "true") == 0) {
         return true;
     } else if (strcmp(line, "false") == 0) {
@@ -613,6 +1872,8 @@ void parametersDestroy(Parameters *p)
 {
     if (p->freqs != NULL) free(p->freqs);
     if (p->outputFile != NULL) free(p->outputFile);
+    free(p->cacheDir);
+    for (size_t c = 0; c < MAX_CHANNELS; c++) free(p->channels[c].freqs);
     memset(p, 0, sizeof(*p));
 }
 
@@ -632,10 +1893,7 @@ void stripChars(char *restrict string, int (*isChar)(int))
     if (end > start) {
         while (isChar(*--end)) *end = '\0';
     }
-    if (start != string) {
-        memmove(string, start, end - start + 1);
-        memset(end, '\0', start - string);
-    }
+    if (start != string) memmove(string, start, strlen(start) + 1);
 }
 
 char *readFileContents(const char *restrict file, FILE *f)
@@ -668,6 +1926,11 @@ char *readFileContents(const char *restrict file, FILE *f)
     return fileBuf;
 }
 
+bool waveIsNoise(WaveType type)
+{
+    return type >= WAVE_WHITE_NOISE;
+}
+
 const char *waveTypeToString(WaveType type)
 {
     switch (type) {
@@ -681,6 +1944,14 @@ const char *waveTypeToString(WaveType type)
         return "saw";
     case WAVE_EVEN:
         return "even";
+    case WAVE_WHITE_NOISE:
+        return "white noise";
+    case WAVE_PINK_NOISE:
+        return "pink noise";
+    case WAVE_BROWN_NOISE:
+        return "brown noise";
+    case WAVE_BAND_NOISE:
+        return "band-limited noise";
     }
 
     return NULL;
@@ -691,215 +1962,5206 @@ const char *sampleFormatToString(SampleFormat fmt)
     return fmt == FMT_INT_PCM ? "Integer" : "Floating-point";
 }
 
-void addWave(double *buf, size_t len, int32_t type, double freq, int32_t rate);
-double gainToDecibels(double gain);
-double decibelsToGain(double decibels);
-bool machineIsBigEndian(void);
-void convertToLittleEndian(void *buf, size_t len, size_t bits);
+const char *oscillatorModeToString(OscillatorMode mode)
+{
+    return mode == OSC_LIBM ? "libm sin()" : "phase recurrence";
+}
 
-WaveChunk waveChunkGenerate(const Parameters *p)
+const char *synthesisModeToString(SynthesisMode mode)
 {
-    double lowestFreq = p->freqs[0];
-    for (size_t i = 1; i < p->freqCount; i++) {
-        if (p->freqs[i] < lowestFreq) lowestFreq = p->freqs[i];        
-    }
+    return mode == SYNTH_EXACT ? "exact (additive)" : "wavetable";
+}
 
-    double maxSamples = p->durationSecs * p->sampleRate;
-    double baseSampleCount = 1.0 / lowestFreq * p->sampleRate;
-    double sampleCount = baseSampleCount;
-    /* making sure we don't get a chunk with an fractional amount of samples */
-    while (sampleCount != (size_t)sampleCount && sampleCount < maxSamples) {
-        sampleCount += baseSampleCount;
-    }
+const char *renderModeToString(RenderMode mode)
+{
+    return mode == RENDER_STREAM ? "streaming blocks" : "repeated chunk";
+}
+
+const char *samplePrecisionToString(SamplePrecision precision)
+{
+    return precision == PRECISION_FLOAT ? "float32" : "float64";
+}
 
-    /* making sure we get at least one second worth of dithered samples */
-    if (p->applyDither) {
-        baseSampleCount = sampleCount;
-        while (sampleCount < p->sampleRate) sampleCount += baseSampleCount;
+const char *sweepModeToString(SweepMode mode)
+{
+    switch (mode) {
+    case SWEEP_NONE: return "none";
+    case SWEEP_LINEAR: return "linear";
+    case SWEEP_EXPONENTIAL: return "exponential";
     }
 
-#ifndef NDEBUG
-    printf("sampleCount: %lf (%.2lfKB)\n", sampleCount, sampleCount / KB);
-    printf("minfreq: %lf, secs: %lf\n", lowestFreq, 1.0 / lowestFreq);
-#endif    
+    return "unknown";
+}
 
-    double *buf = calloc(sampleCount, sizeof(*buf));
-    if (buf == NULL) {
-        ERR_OUT_OF_MEMORY();
-        exit(EXIT_FAILURE);
+const char *peakModeToString(PeakMode mode)
+{
+    switch (mode) {
+    case PEAK_AUTO: return "auto";
+    case PEAK_EXACT: return "exact (searched)";
+    case PEAK_ANALYTIC: return "analytic (predicted)";
     }
 
-    for (size_t i = 0; i < p->freqCount; i++) {
-        addWave(buf, sampleCount, p->waveType, p->freqs[i], p->sampleRate);
+    return "unknown";
+}
+
+const char *outputBackendToString(OutputBackend backend)
+{
+    switch (backend) {
+    case OUT_AUTO: return "auto";
+    case OUT_STDIO: return "stdio";
+    case OUT_MMAP: return "mmap";
+    case OUT_URING: return "uring";
     }
 
-    double posPeak = buf[0], negPeak = posPeak;
-    for (size_t i = 1; i < sampleCount; i++) {
-        if (buf[i] > posPeak) posPeak = buf[i];
-        else if (buf[i] < negPeak) negPeak = buf[i];
+    return "unknown";
+}
+
+SimdLevel parseSimdLevel(const char *arg)
+{
+    if (strcmp(arg, "scalar") == 0) return SIMD_SCALAR;
+    if (strcmp(arg, "sse2") == 0) return SIMD_SSE2;
+    if (strcmp(arg, "avx2") == 0) return SIMD_AVX2;
+    if (strcmp(arg, "avx512") == 0) return SIMD_AVX512;
+    if (strcmp(arg, "neon") == 0) return SIMD_NEON;
+
+    loggerAppend(ERR_ARG, "unrecognized SIMD level '%s' (ignoring)", arg);
+    return SIMD_AUTO;
+}
+
+/* the '--threads' count (0 means one per core), or -1 if it isn't one */
+long parseThreadCount(const char *arg)
+{
+    errno = 0;
+    char *end = NULL;
+    long threadCount = strtol(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || threadCount < 0 ||
+        threadCount > UINT32_MAX) {
+        loggerAppend(ERR_ARG, "invalid thread count '%s' (ignoring)", arg);
+        return -1;
     }
 
-    double absPeak = posPeak > -negPeak ? posPeak : -negPeak;
-    absPeak /= decibelsToGain(p->amplitude);
-    if (absPeak != 1.0) {
-        for (size_t i = 0; i < sampleCount; i++) {
-            buf[i] /= absPeak;
-        }
+    return threadCount;
+}
+
+const char *simdLevelToString(SimdLevel level)
+{
+    switch (level) {
+    case SIMD_SCALAR:
+        return "scalar";
+    case SIMD_SSE2:
+        return "SSE2";
+    case SIMD_AVX2:
+        return "AVX2";
+    case SIMD_AVX512:
+        return "AVX-512";
+    case SIMD_NEON:
+        return "NEON";
+    case SIMD_AUTO:
+        return "auto";
     }
 
-    return (WaveChunk){
-        .buf = buf,
-        .sampleCount = sampleCount,    
-    };
+    return NULL;
 }
 
-#define BELOW_NYQUIST(freq, rate) (freq < rate / 2.0)
-#define SINE_WAVE(freq, factor, rate, i) \
-    (double)(sin((2.0 * PI * freq * factor) / rate * i))
+/* the oscillators re-seed their phase from the exact value every time the
+   absolute sample index crosses a multiple of this, which bounds the rounding
+   drift of the recurrence to a handful of ULPs and makes every sample depend
+   only on its own index, as long as buffers start on a multiple of it */
+#define OSC_RESYNC_INTERVAL 1024
+#define MAX_THREADS 256
 
-void addWave(double *buf, size_t len, int32_t type, double freq, int32_t rate)
+typedef void (*TileFunc)(void *ctx, size_t tile, size_t start, size_t len);
+
+size_t parallelFor(size_t len, TileFunc fn, void *ctx);
+void parallelTasks(size_t count, TileFunc fn, void *ctx);
+
+bool threadCreate(Thread *t, THREAD_FUNC((*fn)), void *arg)
 {
-    double factor = 1.0, amp = 1.0;
-    switch (type) {
-    case WAVE_SINE: {
-        for (size_t i = 0; i < len; i++) {
-            buf[i] = SINE_WAVE(freq, factor, rate, i);
-        }
-    } break;
-    case WAVE_TRIANGLE: {
-        double phase = -1.0;
-        while (BELOW_NYQUIST(freq * factor, rate)) {
-            phase *= -1.0;
-            amp = 1.0 / (factor * factor);
-            for (size_t i = 0; i < len; i++) {
-                buf[i] += SINE_WAVE(freq, factor, rate, i) * amp * phase;
-            }
+#if defined _WIN32
+    *t = CreateThread(NULL, 0, fn, arg, 0, NULL);
+    return *t != NULL;
+#else
+    return pthread_create(t, NULL, fn, arg) == 0;
+#endif
+}
 
-            factor += 2.0;
-        }
-    } break;
-    case WAVE_SQUARE: {
-        while (BELOW_NYQUIST(freq * factor, rate)) {
-            amp = 4.0 / (factor * PI);
-            for (size_t i = 0; i < len; i++) {
-                buf[i] += SINE_WAVE(freq, factor, rate, i) * amp;
-            }
+void threadJoin(Thread t)
+{
+#if defined _WIN32
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+#else
+    pthread_join(t, NULL);
+#endif
+}
 
-            factor += 2.0;
-        }
-    } break;
-    case WAVE_SAW: {
-        while (BELOW_NYQUIST(freq * factor, rate)) {
-            amp = 1.0 / factor;
-            for (size_t i = 0; i < len; i++) {
-                buf[i] += SINE_WAVE(freq, factor, rate, i) * amp;
-            }
+/* seconds since some arbitrary (but fixed) point, for timing */
+double monotonicSeconds(void)
+{
+#if defined _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
 
-            factor += 1.0;
-        }
-    } break;
-    case WAVE_EVEN: {
-        while (BELOW_NYQUIST(freq * factor, rate)) {
-            amp = 1.0 / factor;
-            for (size_t i = 0; i < len; i++) {
-                buf[i] += SINE_WAVE(freq, factor, rate, i) * amp;
-            }
+size_t cpuCount(void)
+{
+#if defined _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+#endif
+}
+
+/* the calling thread always takes part in the work, so a pool of size N only
+   spawns N - 1 workers */
+typedef struct WorkerPool {
+    Thread *workers;
+    size_t size;
+    Mutex lock;
+    Cond wake, done;
+    TileFunc fn;
+    void *ctx;
+    size_t len, tileLen, tileCount, nextTile;
+    size_t busy;
+    uint64_t generation;
+    bool active; // a job is being run
+    bool quit;
+} WorkerPool;
 
-            if (factor == 1.0) factor = 0.0;
+static WorkerPool pool = { .size = 1 };
 
-            factor += 2.0;
+/* claims and runs tiles of the current job until there are none left */
+void workerPoolDrain(void)
+{
+    for (;;) {
+        mutexLock(&pool.lock);
+        if (pool.nextTile >= pool.tileCount) {
+            mutexUnlock(&pool.lock);
+            return;
         }
-    } break;
+
+        size_t tile = pool.nextTile++;
+        TileFunc fn = pool.fn;
+        void *ctx = pool.ctx;
+        size_t start = tile * pool.tileLen;
+        size_t len = pool.len - start;
+        if (len > pool.tileLen) len = pool.tileLen;
+        mutexUnlock(&pool.lock);
+
+        fn(ctx, tile, start, len);
     }
 }
 
-void applyDither(double *buf, size_t len, size_t bits);
-
-AudioBuffer audioBufferBuild(const Parameters *p)
+THREAD_FUNC(workerMain)
 {
-    loggerAppend(LOG_INFO, "generating base wave(s)");
-    WaveChunk w = waveChunkGenerate(p);
-    double *src = w.buf;
-    size_t len = w.sampleCount;
-    size_t bits = p->bitsPerSample;
-    size_t bytes = bits / 8;
+    (void)arg;
+    uint64_t seen = 0;
+    mutexLock(&pool.lock);
+    for (;;) {
+        while (!pool.quit && pool.generation == seen) {
+            condWait(&pool.wake, &pool.lock);
+        }
 
-    if (p->sampleFormat == FMT_INT_PCM && p->applyDither) {
-        loggerAppend(LOG_INFO, "applying %zu-bit TPDF dither", bits);
-        applyDither(src, len, bits);
+        if (pool.quit) break;
+
+        seen = pool.generation;
+        pool.busy += 1;
+        mutexUnlock(&pool.lock);
+        workerPoolDrain();
+        mutexLock(&pool.lock);
+        if (--pool.busy == 0) condBroadcast(&pool.done);
     }
 
-    void *buf = (bits == 64) ? src : malloc(len * bytes);
-    if (buf == NULL) {
+    mutexUnlock(&pool.lock);
+    return 0;
+}
+
+void workerPoolInit(size_t threads)
+{
+    if (threads == 0) threads = cpuCount();
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+
+    mutexInit(&pool.lock);
+    condInit(&pool.wake);
+    condInit(&pool.done);
+    pool.size = 1;
+    if (threads == 1) return;
+
+    pool.workers = malloc((threads - 1) * sizeof(*pool.workers));
+    if (pool.workers == NULL) {
         ERR_OUT_OF_MEMORY();
         exit(EXIT_FAILURE);
     }
-    
-    switch (p->sampleFormat) {
-    case FMT_INT_PCM: {
-        loggerAppend(LOG_INFO, "truncating to %zu-bit integer", bits);
-        size_t maxInt = (size_t)((pow(2.0, bits - 1.0) - 1.0));
-        switch (bits) {
-        case 8: {
-            const uint8_t offset = INT8_MAX + 1;
-            for (size_t i = 0; i < len; i++) {
-                ((uint8_t*)buf)[i] = (uint8_t)lround(src[i] * maxInt + offset);
-            }
-        } break;
-        case 16: {
-            for (size_t i = 0; i < len; i++) {
-                ((int16_t*)buf)[i] = (int16_t)lround(src[i] * maxInt);
-            }
-        } break;
-        case 24: {
-            enum { word = 3 * sizeof(int8_t) };
-            for (size_t i = 0; i < len; i++) {
-                int32_t val = (int32_t)lround(src[i] * maxInt);
-                for (size_t j = 0, offset = 0; j < word; j++, offset += 8) {
-                    ((int8_t*)buf)[i * word + j] = (int8_t)(val >> offset);
-                }
-            }
-        } break;
-        case 32: {
-            for (size_t i = 0; i < len; i++) {
-                ((int32_t*)buf)[i] = (int32_t)lround(src[i] * maxInt);
-            }
-        } break;
+
+    for (size_t i = 0; i < threads - 1; i++) {
+        if (!threadCreate(&pool.workers[i], workerMain, NULL)) {
+            loggerAppend(ERR_ARG, "unable to start more than %zu thread(s)",
+                pool.size);
+            break;
         }
-    } break;
-    case FMT_FLOAT_PCM: {
-        switch (bits) {
-        case 32: {
-            for (size_t i = 0; i < len; i++) {
-                ((float*)buf)[i] = (float)(src[i]);
+
+        pool.size += 1;
+    }
+}
+
+void workerPoolDestroy(void)
+{
+    mutexLock(&pool.lock);
+    pool.quit = true;
+    condBroadcast(&pool.wake);
+    mutexUnlock(&pool.lock);
+    for (size_t i = 0; i + 1 < pool.size; i++) threadJoin(pool.workers[i]);
+
+    free(pool.workers);
+    mutexDestroy(&pool.lock);
+    condDestroy(&pool.wake);
+    condDestroy(&pool.done);
+    memset(&pool, 0, sizeof(pool));
+    pool.size = 1;
+}
+
+size_t workerPoolSize(void)
+{
+    return pool.size;
+}
+
+/* runs 'fn' over [0, len) in tiles of 'tileLen' across the pool. Calls made
+   from within a running job (like a batch job's renders) can't be handed to
+   the pool again, so they run inline as a single tile */
+size_t workerPoolRun(size_t len, size_t tileLen, TileFunc fn, void *ctx)
+{
+    size_t tileCount = (len + tileLen - 1) / tileLen;
+    mutexLock(&pool.lock);
+    if (tileCount == 1 || pool.active) {
+        mutexUnlock(&pool.lock);
+        fn(ctx, 0, 0, len);
+        return 1;
+    }
+
+    pool.fn = fn, pool.ctx = ctx;
+    pool.len = len, pool.tileLen = tileLen;
+    pool.tileCount = tileCount, pool.nextTile = 0;
+    pool.generation += 1;
+    pool.active = true;
+    condBroadcast(&pool.wake);
+    mutexUnlock(&pool.lock);
+
+    workerPoolDrain();
+
+    mutexLock(&pool.lock);
+    while (pool.busy > 0) condWait(&pool.done, &pool.lock);
+    pool.active = false;
+    mutexUnlock(&pool.lock);
+
+    return tileCount;
+}
+
+/* splits [0, len) into one tile per thread and runs 'fn' on each of them,
+   returning the amount of tiles. Tiles are aligned to OSC_RESYNC_INTERVAL
+   (so synthesis is bit-identical to a single-threaded run) and numbered in
+   order, so per-tile results can be reduced deterministically */
+size_t parallelFor(size_t len, TileFunc fn, void *ctx)
+{
+    if (len == 0) return 0;
+
+    size_t tileLen = (len + pool.size - 1) / pool.size;
+    tileLen += OSC_RESYNC_INTERVAL - 1;
+    tileLen -= tileLen % OSC_RESYNC_INTERVAL;
+    return workerPoolRun(len, tileLen, fn, ctx);
+}
+
+/* runs 'fn' once for every task in [0, count), handing them out one at a
+   time to whichever thread is free (so uneven tasks still balance out) */
+void parallelTasks(size_t count, TileFunc fn, void *ctx)
+{
+    if (count > 0) workerPoolRun(count, 1, fn, ctx);
+}
+
+typedef struct HarmonicPlan HarmonicPlan;
+const HarmonicPlan *harmonicPlanFor(WaveType type, double freq, uint32_t rate);
+void harmonicPlanRelease(const HarmonicPlan *plan);
+size_t harmonicPlanCount(const HarmonicPlan *plan);
+void addWave(double *buf, size_t start, size_t len, const HarmonicPlan *plan,
+    OscillatorMode osc);
+const double *wavetableOctaveFor(WaveType type, double freq, uint32_t rate,
+    size_t *len);
+const double *wavetableOctave(WaveType type, size_t octave, size_t *len);
+bool peakPredict(const Parameters *p, size_t scanLen, size_t total,
+    double gains[MAX_CHANNELS]);
+void wavetableAdd(double *buf, size_t start, size_t len, const double *t,
+    size_t tableLen, double freq, uint32_t rate);
+void sweepAdd(double *buf, size_t start, size_t len, WaveType type,
+    const Parameters *p);
+void noiseRender(const Parameters *p, const Channel *ch, void *buf,
+    size_t start, size_t len);
+double noisePeakBound(const Parameters *p, WaveType type);
+bool waveIsAperiodic(const Parameters *p);
+void sweepOctaves(const Parameters *p, WaveType type, size_t *first,
+    size_t *last);
+double gainToDecibels(double gain);
+double decibelsToGain(double decibels);
+bool machineIsBigEndian(void);
+void convertToLittleEndian(void *buf, size_t len, size_t bits);
+
+#define PERIOD_MAX_DECIMALS 9
+
+typedef struct TraceEvent {
+    StatSpan span;
+    size_t thread;
+    double begin, end;
+} TraceEvent;
+
+/* stages are timed on whichever thread calls them (which, for batch jobs,
+   is any worker), while the tile functions they hand out stay untouched */
+typedef struct Stats {
+    Mutex lock;
+    bool ready;
+    double start;
+    double spanSecs[SPAN_COUNT];
+    size_t spanCalls[SPAN_COUNT];
+    uint64_t counters[COUNTER_COUNT];
+    const char *traceFile;
+    TraceEvent *events;
+    size_t eventCount, eventCap;
+    ThreadId threads[MAX_THREADS];
+    size_t threadCount;
+} Stats;
+
+static Stats stats = {0};
+
+static const char *spanNames[SPAN_COUNT] = {
+    "parse", "render", "peak", "dither", "quantize", "write"
+};
+
+void statsInit(void)
+{
+    if (stats.ready) return;
+
+    mutexInit(&stats.lock);
+    stats.start = monotonicSeconds();
+    stats.ready = true;
+}
+
+/* also records every span, to be written to 'file' (in the Chrome trace
+   event format, which Perfetto opens as well) at loggerClose */
+void statsTrace(const char *file)
+{
+    stats.traceFile = file;
+}
+
+double spanBegin(void)
+{
+    return monotonicSeconds();
+}
+
+/* small, stable thread numbers for the trace (the lock must be held) */
+size_t statsThreadIndex(void)
+{
+    ThreadId self = threadSelf();
+    for (size_t i = 0; i < stats.threadCount; i++) {
+        if (threadIdEqual(stats.threads[i], self)) return i;
+    }
+
+    if (stats.threadCount == MAX_THREADS) return MAX_THREADS - 1;
+
+    stats.threads[stats.threadCount] = self;
+    return stats.threadCount++;
+}
+
+void spanEnd(StatSpan span, double begin)
+{
+    if (!stats.ready) return;
+
+    double end = monotonicSeconds();
+    mutexLock(&stats.lock);
+    stats.spanSecs[span] += end - begin;
+    stats.spanCalls[span] += 1;
+    if (stats.traceFile != NULL) {
+        if (stats.eventCount == stats.eventCap) {
+            size_t cap = stats.eventCap ? stats.eventCap * 2 : 4 * KB;
+            TraceEvent *events = realloc(stats.events,
+                cap * sizeof(*events));
+            if (events == NULL) {
+                /* tracing is best-effort, it must not end the run */
+                stats.traceFile = NULL;
+                mutexUnlock(&stats.lock);
+                loggerAppend(ERR_ARG, "out of memory for trace events"
+                    " (disabling the trace)");
+                return;
             }
-        } break;
+
+            stats.events = events;
+            stats.eventCap = cap;
         }
-    } break;
+
+        stats.events[stats.eventCount++] = (TraceEvent){
+            .span = span,
+            .thread = statsThreadIndex(),
+            .begin = begin,
+            .end = end,
+        };
     }
 
-    if (bits != 64) free(src);
-    if (machineIsBigEndian()) convertToLittleEndian(buf, len, bits);
+    mutexUnlock(&stats.lock);
+}
+
+void counterAdd(StatCounter counter, uint64_t n)
+{
+    if (!stats.ready) return;
 
-    return (AudioBuffer){
+    mutexLock(&stats.lock);
+    stats.counters[counter] += n;
+    mutexUnlock(&stats.lock);
+}
+
+void statsTraceWrite(const char *file)
+{
+    FILE *f = fopen(file, "w");
+    if (f == NULL) {
+        loggerAppend(ERR_ARG, "unable to open trace file '%s': %s", file,
+            strerror(errno));
+        return;
+    }
+
+    /* timestamps are in microseconds since the logger was started */
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (size_t i = 0; i < stats.eventCount; i++) {
+        const TraceEvent *e = &stats.events[i];
+        fprintf(f, "{\"name\":\"%s\",\"cat\":\"wavgen\",\"ph\":\"X\","
+            "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%zu},\n",
+            spanNames[e->span], (e->begin - stats.start) * 1e6,
+            (e->end - e->begin) * 1e6, e->thread);
+    }
+
+    fprintf(f, "{\"name\":\"totals\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,"
+        "\"args\":{\"samples\":%llu,\"partials\":%llu,\"bytes\":%llu}}\n]}\n",
+        (monotonicSeconds() - stats.start) * 1e6,
+        (unsigned long long)stats.counters[COUNTER_SAMPLES],
+        (unsigned long long)stats.counters[COUNTER_PARTIALS],
+        (unsigned long long)stats.counters[COUNTER_BYTES]);
+    if (fclose(f) != 0) {
+        loggerAppend(ERR_ARG, "unable to write trace file '%s': %s", file,
+            strerror(errno));
+        return;
+    }
+
+    loggerAppend(LOG_INFO, "%zu span(s) traced to '%s'", stats.eventCount,
+        file);
+}
+
+/* logs where the run spent its time (spans on different threads overlap,
+   so their sum can exceed it) and writes the trace, if one was asked for */
+void statsReport(void)
+{
+    if (!stats.ready) return;
+
+    mutexLock(&stats.lock);
+    stats.ready = false;
+    mutexUnlock(&stats.lock);
+    mutexDestroy(&stats.lock);
+
+    double total = monotonicSeconds() - stats.start;
+    bool any = false;
+    for (size_t i = 0; i < SPAN_COUNT; i++) {
+        if (stats.spanCalls[i] == 0) continue;
+
+        loggerAppend(LOG_INFO, "%-9s %10.3lfms in %zu span(s) (%.1lf%%)",
+            spanNames[i], stats.spanSecs[i] * 1e3, stats.spanCalls[i],
+            total > 0.0 ? stats.spanSecs[i] / total * 100.0 : 0.0);
+        any = true;
+    }
+
+    if (any) {
+        loggerAppend(LOG_INFO, "rendered %llu samples (%llu harmonics summed)"
+            " and wrote %llu bytes in %.3lfs",
+            (unsigned long long)stats.counters[COUNTER_SAMPLES],
+            (unsigned long long)stats.counters[COUNTER_PARTIALS],
+            (unsigned long long)stats.counters[COUNTER_BYTES], total);
+    }
+
+    if (stats.traceFile != NULL) statsTraceWrite(stats.traceFile);
+    free(stats.events);
+    stats.events = NULL;
+}
+
+uint64_t gcd64(uint64_t a, uint64_t b)
+{
+    while (b != 0) {
+        uint64_t t = a % b;
+        a = b, b = t;
+    }
+
+    return a;
+}
+
+/* recovers the decimal fraction a frequency was written as (like 440.25 ->
+   1761/4), provided it has no more than PERIOD_MAX_DECIMALS decimals */
+bool frequencyToRational(double freq, uint64_t *num, uint64_t *den)
+{
+    uint64_t scale = 1;
+    for (int i = 0; i <= PERIOD_MAX_DECIMALS; i++, scale *= 10) {
+        double scaled = freq * (double)scale;
+        if (!(scaled > 0.0) || scaled >= 9007199254740992.0) return false;
+
+        double whole = floor(scaled + 0.5);
+        if (whole > 0.0 && fabs(scaled - whole) <= scaled * 4.0 * DBL_EPSILON) {
+            uint64_t g = gcd64((uint64_t)whole, scale);
+            *num = (uint64_t)whole / g, *den = scale / g;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* sweeps and noise never come back around */
+bool waveIsAperiodic(const Parameters *p)
+{
+    bool noise = false;
+    for (size_t c = 0; c < p->channelCount; c++) {
+        noise |= waveIsNoise(p->channels[c].waveType);
+    }
+
+    return noise || p->sweep != SWEEP_NONE;
+}
+
+/* smallest amount of samples after which every tone of every channel is back
+   at its starting phase (the LCM of their periods, computed exactly), or 0 if
+   there is none that fits in 64 bits */
+size_t wavePeriodLength(const Parameters *p)
+{
+    uint64_t period = 1;
+    if (waveIsAperiodic(p)) return 0;
+    for (size_t c = 0; c < p->channelCount; c++) {
+        const Channel *ch = &p->channels[c];
+        for (size_t i = 0; i < ch->freqCount; i++) {
+            uint64_t num = 0, den = 0;
+            if (!frequencyToRational(ch->freqs[i], &num, &den)) return 0;
+
+            /* 'n' samples hold 'n * num / (den * rate)' cycles, which is a
+               whole number once 'n' is a multiple of 'len' */
+            uint64_t cycle = den * p->sampleRate;
+            uint64_t len = cycle / gcd64(num, cycle);
+            uint64_t g = gcd64(period, len);
+            if (period / g > UINT64_MAX / len) return 0;
+
+            period = period / g * len;
+        }
+    }
+
+    return period <= SIZE_MAX ? (size_t)period : 0;
+}
+
+/* length of the chunk that gets repeated: one whole period (or the whole wave
+   if it's shorter or has none), stretched to at least a second's worth of
+   samples when dithering so that the dither doesn't loop too often */
+size_t waveChunkLength(const Parameters *p)
+{
+    size_t total = waveSampleCount(p);
+    size_t period = wavePeriodLength(p);
+    size_t len = period == 0 || period > total ? total : period;
+    if (p->applyDither && len > 0 && len < p->sampleRate) {
+        len *= (p->sampleRate + len - 1) / len;
+    }
+
+    return len;
+}
+
+/* float samples halve the memory traffic of every pass after synthesis (and
+   double the lanes of its kernels), but 32-bit integer and 64-bit float output
+   need more bits than they have */
+SamplePrecision samplePrecision(const Parameters *p)
+{
+    bool wide = p->bitsPerSample == 64 ||
+        (p->sampleFormat == FMT_INT_PCM && p->bitsPerSample == 32);
+    return wide ? PRECISION_DOUBLE : p->precision;
+}
+
+size_t sampleSize(const Parameters *p)
+{
+    return samplePrecision(p) == PRECISION_FLOAT ? sizeof(float) :
+        sizeof(double);
+}
+
+/* address of sample 'i' of a buffer in the wave's sample precision */
+void *sampleAt(const Parameters *p, void *buf, size_t i)
+{
+    return (uint8_t*)buf + i * sampleSize(p);
+}
+
+#define SAMPLE_ALIGN 64 // a cache line, and the widest vector (AVX-512)
+
+/* allocates 'channels' planes of at least 'len' samples of 'size' bytes, each
+   padded to start on a SAMPLE_ALIGN boundary ('*plane' gets their stride) */
+void *samplesAlloc(size_t len, size_t channels, size_t size, size_t *plane)
+{
+    const size_t lanes = SAMPLE_ALIGN / size;
+    *plane = (len + lanes - 1) / lanes * lanes;
+    size_t bytes = *plane * channels * size;
+    if (bytes == 0) bytes = SAMPLE_ALIGN;
+
+#if defined _WIN32
+    void *buf = _aligned_malloc(bytes, SAMPLE_ALIGN);
+#else
+    void *buf = NULL;
+    if (posix_memalign(&buf, SAMPLE_ALIGN, bytes) != 0) buf = NULL;
+#endif
+    if (buf == NULL) {
+        ERR_OUT_OF_MEMORY();
+        exit(EXIT_FAILURE);
+    }
+
+    return buf;
+}
+
+void samplesFree(void *buf)
+{
+#if defined _WIN32
+    _aligned_free(buf);
+#else
+    free(buf);
+#endif
+}
+
+typedef struct RenderJob {
+    const Parameters *p;
+    const Channel *ch;
+    void *buf;
+    size_t start;
+    bool useTables;
+    const HarmonicPlan **plans; // one per tone, unless it reads tables
+    const double **tables; // one per tone, if it does
+    size_t *tableLens;
+    SamplePrecision precision;
+} RenderJob;
+
+/* tones of float samples are summed up in double precision one block at a
+   time (which stays in L1), then rounded once */
+#define RENDER_SCRATCH_LEN (2 * OSC_RESYNC_INTERVAL)
+
+/* double samples are rendered in place in blocks just as long, every tone
+   (and every harmonic) over one block before the next, so a tile streams
+   through memory once instead of once per tone; the benchmark sets it to 0
+   (a whole tile at a time) to compare, and any other value must stay a
+   multiple of OSC_RESYNC_INTERVAL for the samples to come out the same */
+static size_t renderBlockLen = RENDER_SCRATCH_LEN;
+
+void renderTones(const RenderJob *job, double *buf, size_t start, size_t len)
+{
+    const Parameters *p = job->p;
+    const Channel *ch = job->ch;
+    memset(buf, 0, len * sizeof(*buf));
+    if (p->sweep != SWEEP_NONE) {
+        sweepAdd(buf, start, len, ch->waveType, p);
+        return;
+    }
+
+    for (size_t i = 0; i < ch->freqCount; i++) {
+        if (job->useTables) {
+            wavetableAdd(buf, start, len, job->tables[i], job->tableLens[i],
+                ch->freqs[i], p->sampleRate);
+        } else {
+            addWave(buf, start, len, job->plans[i], p->oscillator);
+        }
+    }
+}
+
+/* rounds samples to float in runs of 8, which compilers vectorize */
+void narrowSamples(float *dst, const double *src, size_t len)
+{
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        for (size_t j = 0; j < 8; j++) dst[i + j] = (float)src[i + j];
+    }
+
+    for (; i < len; i++) dst[i] = (float)src[i];
+}
+
+void renderTile(void *ctx, size_t tile, size_t start, size_t len)
+{
+    (void)tile;
+    const RenderJob *job = ctx;
+    if (job->precision == PRECISION_DOUBLE) {
+        double *buf = (double*)job->buf + start;
+        size_t block = renderBlockLen > 0 ? renderBlockLen : len;
+        for (size_t i = 0; i < len; i += block) {
+            size_t n = len - i < block ? len - i : block;
+            renderTones(job, buf + i, job->start + start + i, n);
+        }
+
+        return;
+    }
+
+    double scratch[RENDER_SCRATCH_LEN];
+    float *buf = (float*)job->buf + start;
+    for (size_t i = 0; i < len; i += RENDER_SCRATCH_LEN) {
+        size_t n = len - i < RENDER_SCRATCH_LEN ? len - i : RENDER_SCRATCH_LEN;
+        renderTones(job, scratch, job->start + start + i, n);
+        narrowSamples(buf + i, scratch, n);
+    }
+}
+
+/* renders samples [start, start+len) of a channel's (unnormalized) tone set
+   in the wave's sample precision, where 'start' must be a multiple of
+   OSC_RESYNC_INTERVAL */
+void waveRender(const Parameters *p, const Channel *ch, void *buf,
+    size_t start, size_t len)
+{
+    if (waveIsNoise(ch->waveType)) {
+        noiseRender(p, ch, buf, start, len);
+        return;
+    }
+
+    RenderJob job = {
+        .p = p,
+        .ch = ch,
         .buf = buf,
-        .sampleCount = len,
-        .bytesPerSample = bits / 8,
+        .start = start,
+        .precision = samplePrecision(p),
+        .useTables = p->synthesis == SYNTH_WAVETABLE &&
+            ch->waveType != WAVE_SINE,
     };
+
+    /* tables are built lazily, so they must exist before the workers race
+       to read them (which they do without going through the lock) */
+    if (job.useTables) {
+        job.tables = malloc(ch->freqCount * sizeof(*job.tables));
+        job.tableLens = malloc(ch->freqCount * sizeof(*job.tableLens));
+        if (job.tables == NULL || job.tableLens == NULL) {
+            ERR_OUT_OF_MEMORY();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (size_t i = 0; i < ch->freqCount && job.useTables; i++) {
+        job.tables[i] = wavetableOctaveFor(ch->waveType, ch->freqs[i],
+            p->sampleRate, &job.tableLens[i]);
+    }
+
+    /* and so must the plans of the tones summed up harmonic by harmonic */
+    bool usePlans = !job.useTables && p->sweep == SWEEP_NONE;
+    if (usePlans) {
+        job.plans = malloc(ch->freqCount * sizeof(*job.plans));
+        if (job.plans == NULL) {
+            ERR_OUT_OF_MEMORY();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (size_t i = 0; i < ch->freqCount && usePlans; i++) {
+        job.plans[i] = harmonicPlanFor(ch->waveType, ch->freqs[i],
+            p->sampleRate);
+    }
+
+    size_t first = 0, last = 0, tableLen = 0;
+    if (p->sweep != SWEEP_NONE) sweepOctaves(p, ch->waveType, &first, &last);
+    for (size_t o = first; o <= last && p->sweep != SWEEP_NONE; o++) {
+        wavetableOctave(ch->waveType, o, &tableLen);
+    }
+
+    double begin = spanBegin();
+    parallelFor(len, renderTile, &job);
+    spanEnd(SPAN_RENDER, begin);
+
+    /* a table lookup counts as a single harmonic */
+    uint64_t partials = 0;
+    for (size_t i = 0; i < ch->freqCount; i++) {
+        partials += usePlans ? harmonicPlanCount(job.plans[i]) : 1;
+    }
+
+    if (p->sweep != SWEEP_NONE) partials = 1;
+
+    for (size_t i = 0; i < ch->freqCount && usePlans; i++) {
+        harmonicPlanRelease(job.plans[i]);
+    }
+
+    free(job.plans);
+    free(job.tables);
+    free(job.tableLens);
+
+    counterAdd(COUNTER_SAMPLES, len);
+    counterAdd(COUNTER_PARTIALS, partials * len);
 }
 
-void audioBufferDestroy(AudioBuffer *b)
+/* widens '*lo' and '*hi' so that they cover every sample in 'buf' */
+typedef void (*PeakKernel)(const double *buf, size_t len, double *lo,
+    double *hi);
+
+typedef void (*PeakFloatKernel)(const float *buf, size_t len, float *lo,
+    float *hi);
+
+void peakScalar(const double *buf, size_t len, double *lo, double *hi);
+void peakFloatScalar(const float *buf, size_t len, float *lo, float *hi);
+
+static PeakKernel peakKernel = peakScalar;
+static PeakFloatKernel peakFloatKernel = peakFloatScalar;
+
+typedef struct PeakJob {
+    const void *buf;
+    SamplePrecision precision;
+    double pos[MAX_THREADS];
+    double neg[MAX_THREADS];
+} PeakJob;
+
+void peakTile(void *ctx, size_t tile, size_t start, size_t len)
 {
-    free(b->buf);
-    memset(b, 0, sizeof(*b));
+    PeakJob *job = ctx;
+    if (job->precision == PRECISION_FLOAT) {
+        const float *buf = (const float*)job->buf + start;
+        float posPeak = buf[0], negPeak = posPeak;
+        peakFloatKernel(buf, len, &negPeak, &posPeak);
+        job->pos[tile] = posPeak, job->neg[tile] = negPeak;
+        return;
+    }
+
+    const double *buf = (const double*)job->buf + start;
+    double posPeak = buf[0], negPeak = posPeak;
+    peakKernel(buf, len, &negPeak, &posPeak);
+    job->pos[tile] = posPeak, job->neg[tile] = negPeak;
+}
+
+/* widens '*pos' and '*neg' so that they cover every sample in 'buf' (of
+   samples in the given precision) */
+void bufferPeaks(const void *buf, size_t len, SamplePrecision precision,
+    double *pos, double *neg)
+{
+    double begin = spanBegin();
+    PeakJob job = { .buf = buf, .precision = precision };
+    size_t tiles = parallelFor(len, peakTile, &job);
+    for (size_t i = 0; i < tiles; i++) {
+        if (job.pos[i] > *pos) *pos = job.pos[i];
+        if (job.neg[i] < *neg) *neg = job.neg[i];
+    }
+
+    spanEnd(SPAN_PEAK, begin);
+}
+
+void peakScalar(const double *buf, size_t len, double *lo, double *hi)
+{
+    double l = *lo, h = *hi;
+    for (size_t i = 0; i < len; i++) {
+        l = buf[i] < l ? buf[i] : l;
+        h = buf[i] > h ? buf[i] : h;
+    }
+
+    *lo = l, *hi = h;
+}
+
+#if defined SIMD_X86
+__attribute__((target("sse2")))
+void peakSse2(const double *buf, size_t len, double *lo, double *hi)
+{
+    size_t i = 0;
+    __m128d l0 = _mm_set1_pd(*lo), l1 = l0;
+    __m128d h0 = _mm_set1_pd(*hi), h1 = h0;
+    for (; i + 4 <= len; i += 4) {
+        __m128d a = _mm_loadu_pd(buf + i), b = _mm_loadu_pd(buf + i + 2);
+        l0 = _mm_min_pd(l0, a), l1 = _mm_min_pd(l1, b);
+        h0 = _mm_max_pd(h0, a), h1 = _mm_max_pd(h1, b);
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_min_pd(l0, l1));
+    *lo = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+    _mm_storeu_pd(lanes, _mm_max_pd(h0, h1));
+    *hi = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+    peakScalar(buf + i, len - i, lo, hi);
+}
+
+__attribute__((target("avx2")))
+void peakAvx2(const double *buf, size_t len, double *lo, double *hi)
+{
+    size_t i = 0;
+    __m256d l0 = _mm256_set1_pd(*lo), l1 = l0;
+    __m256d h0 = _mm256_set1_pd(*hi), h1 = h0;
+    for (; i + 8 <= len; i += 8) {
+        __m256d a = _mm256_loadu_pd(buf + i);
+        __m256d b = _mm256_loadu_pd(buf + i + 4);
+        l0 = _mm256_min_pd(l0, a), l1 = _mm256_min_pd(l1, b);
+        h0 = _mm256_max_pd(h0, a), h1 = _mm256_max_pd(h1, b);
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_min_pd(l0, l1));
+    *lo = lanes[0];
+    for (size_t j = 1; j < 4; j++) *lo = lanes[j] < *lo ? lanes[j] : *lo;
+    _mm256_storeu_pd(lanes, _mm256_max_pd(h0, h1));
+    *hi = lanes[0];
+    for (size_t j = 1; j < 4; j++) *hi = lanes[j] > *hi ? lanes[j] : *hi;
+    peakScalar(buf + i, len - i, lo, hi);
+}
+
+__attribute__((target("avx512f")))
+void peakAvx512(const double *buf, size_t len, double *lo, double *hi)
+{
+    size_t i = 0;
+    __m512d l0 = _mm512_set1_pd(*lo), l1 = l0;
+    __m512d h0 = _mm512_set1_pd(*hi), h1 = h0;
+    for (; i + 16 <= len; i += 16) {
+        __m512d a = _mm512_loadu_pd(buf + i);
+        __m512d b = _mm512_loadu_pd(buf + i + 8);
+        l0 = _mm512_min_pd(l0, a), l1 = _mm512_min_pd(l1, b);
+        h0 = _mm512_max_pd(h0, a), h1 = _mm512_max_pd(h1, b);
+    }
+
+    *lo = _mm512_reduce_min_pd(_mm512_min_pd(l0, l1));
+    *hi = _mm512_reduce_max_pd(_mm512_max_pd(h0, h1));
+    peakScalar(buf + i, len - i, lo, hi);
+}
+#endif
+
+#if defined SIMD_NEON
+void peakNeon(const double *buf, size_t len, double *lo, double *hi)
+{
+    size_t i = 0;
+    float64x2_t l0 = vdupq_n_f64(*lo), l1 = l0;
+    float64x2_t h0 = vdupq_n_f64(*hi), h1 = h0;
+    for (; i + 4 <= len; i += 4) {
+        float64x2_t a = vld1q_f64(buf + i), b = vld1q_f64(buf + i + 2);
+        l0 = vminq_f64(l0, a), l1 = vminq_f64(l1, b);
+        h0 = vmaxq_f64(h0, a), h1 = vmaxq_f64(h1, b);
+    }
+
+    *lo = vminvq_f64(vminq_f64(l0, l1));
+    *hi = vmaxvq_f64(vmaxq_f64(h0, h1));
+    peakScalar(buf + i, len - i, lo, hi);
 }
+#endif
 
-void applyDither(double *buf, size_t len, size_t bits)
+void peakFloatScalar(const float *buf, size_t len, float *lo, float *hi)
 {
-    const double amp = 1.0 / pow(2.0, bits - 1.0) / RAND_MAX;
+    float l = *lo, h = *hi;
     for (size_t i = 0; i < len; i++) {
-        buf[i] += (double)(rand() - rand()) * amp;
+        l = buf[i] < l ? buf[i] : l;
+        h = buf[i] > h ? buf[i] : h;
+    }
+
+    *lo = l, *hi = h;
+}
+
+#if defined SIMD_X86
+__attribute__((target("sse2")))
+void peakFloatSse2(const float *buf, size_t len, float *lo, float *hi)
+{
+    size_t i = 0;
+    __m128 l0 = _mm_set1_ps(*lo), l1 = l0;
+    __m128 h0 = _mm_set1_ps(*hi), h1 = h0;
+    for (; i + 8 <= len; i += 8) {
+        __m128 a = _mm_loadu_ps(buf + i), b = _mm_loadu_ps(buf + i + 4);
+        l0 = _mm_min_ps(l0, a), l1 = _mm_min_ps(l1, b);
+        h0 = _mm_max_ps(h0, a), h1 = _mm_max_ps(h1, b);
     }
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_min_ps(l0, l1));
+    *lo = lanes[0];
+    for (size_t j = 1; j < 4; j++) *lo = lanes[j] < *lo ? lanes[j] : *lo;
+    _mm_storeu_ps(lanes, _mm_max_ps(h0, h1));
+    *hi = lanes[0];
+    for (size_t j = 1; j < 4; j++) *hi = lanes[j] > *hi ? lanes[j] : *hi;
+    peakFloatScalar(buf + i, len - i, lo, hi);
+}
+
+__attribute__((target("avx2")))
+void peakFloatAvx2(const float *buf, size_t len, float *lo, float *hi)
+{
+    size_t i = 0;
+    __m256 l0 = _mm256_set1_ps(*lo), l1 = l0;
+    __m256 h0 = _mm256_set1_ps(*hi), h1 = h0;
+    for (; i + 16 <= len; i += 16) {
+        __m256 a = _mm256_loadu_ps(buf + i);
+        __m256 b = _mm256_loadu_ps(buf + i + 8);
+        l0 = _mm256_min_ps(l0, a), l1 = _mm256_min_ps(l1, b);
+        h0 = _mm256_max_ps(h0, a), h1 = _mm256_max_ps(h1, b);
+    }
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, _mm256_min_ps(l0, l1));
+    *lo = lanes[0];
+    for (size_t j = 1; j < 8; j++) *lo = lanes[j] < *lo ? lanes[j] : *lo;
+    _mm256_storeu_ps(lanes, _mm256_max_ps(h0, h1));
+    *hi = lanes[0];
+    for (size_t j = 1; j < 8; j++) *hi = lanes[j] > *hi ? lanes[j] : *hi;
+    peakFloatScalar(buf + i, len - i, lo, hi);
+}
+
+__attribute__((target("avx512f")))
+void peakFloatAvx512(const float *buf, size_t len, float *lo, float *hi)
+{
+    size_t i = 0;
+    __m512 l0 = _mm512_set1_ps(*lo), l1 = l0;
+    __m512 h0 = _mm512_set1_ps(*hi), h1 = h0;
+    for (; i + 32 <= len; i += 32) {
+        __m512 a = _mm512_loadu_ps(buf + i);
+        __m512 b = _mm512_loadu_ps(buf + i + 16);
+        l0 = _mm512_min_ps(l0, a), l1 = _mm512_min_ps(l1, b);
+        h0 = _mm512_max_ps(h0, a), h1 = _mm512_max_ps(h1, b);
+    }
+
+    *lo = _mm512_reduce_min_ps(_mm512_min_ps(l0, l1));
+    *hi = _mm512_reduce_max_ps(_mm512_max_ps(h0, h1));
+    peakFloatScalar(buf + i, len - i, lo, hi);
+}
+#endif
+
+#if defined SIMD_NEON
+void peakFloatNeon(const float *buf, size_t len, float *lo, float *hi)
+{
+    size_t i = 0;
+    float32x4_t l0 = vdupq_n_f32(*lo), l1 = l0;
+    float32x4_t h0 = vdupq_n_f32(*hi), h1 = h0;
+    for (; i + 8 <= len; i += 8) {
+        float32x4_t a = vld1q_f32(buf + i), b = vld1q_f32(buf + i + 4);
+        l0 = vminq_f32(l0, a), l1 = vminq_f32(l1, b);
+        h0 = vmaxq_f32(h0, a), h1 = vmaxq_f32(h1, b);
+    }
+
+    *lo = vminvq_f32(vminq_f32(l0, l1));
+    *hi = vmaxvq_f32(vmaxq_f32(h0, h1));
+    peakFloatScalar(buf + i, len - i, lo, hi);
+}
+#endif
+
+/* converts the peaks of a channel's raw tone set into the gain that brings
+   them to its requested amplitude */
+double peakToGain(const Channel *ch, double posPeak, double negPeak)
+{
+    double absPeak = posPeak > -negPeak ? posPeak : -negPeak;
+    return decibelsToGain(ch->amplitude) / absPeak;
+}
+
+WaveChunk waveChunkGenerate(const Parameters *p)
+{
+    size_t len = waveChunkLength(p), stride = 0;
+    double gains[MAX_CHANNELS] = {0};
+    void *buf = samplesAlloc(len, p->channelCount, sampleSize(p), &stride);
+
+    /* the whole chunk gets rendered anyway, so searching it costs little */
+    bool predicted = peakPredict(p, 0, len, gains);
+    for (size_t c = 0; c < p->channelCount; c++) {
+        const Channel *ch = &p->channels[c];
+        void *plane = sampleAt(p, buf, c * stride);
+        waveRender(p, ch, plane, 0, len);
+        if (predicted || len == 0) continue;
+
+        double posPeak = 0.0, negPeak = 0.0;
+        bufferPeaks(plane, len, samplePrecision(p), &posPeak, &negPeak);
+        gains[c] = peakToGain(ch, posPeak, negPeak);
+    }
+
+    WaveChunk w = {
+        .buf = buf,
+        .plane = stride,
+        .sampleCount = len,
+        .channelCount = p->channelCount,
+    };
+
+    memcpy(w.gains, gains, sizeof(gains));
+    return w;
+}
+
+#define BELOW_NYQUIST(freq, rate) (freq < rate / 2.0)
+
+#define SINE_WAVE(freq, factor, rate, i) \
+    (double)(sin((2.0 * PI * (freq) * (factor)) / (rate) * (i)))
+
+/* one harmonic of a tone: its frequency, its amplitude (which carries its
+   sign) and the phasor rotation that advances it by a sample */
+typedef struct Harmonic {
+    double freq, amp;
+    double c, s;
+} Harmonic;
+
+/* a tone's harmonic series up to Nyquist, derived once per (WaveType, freq,
+   rate) and shared by every render that holds it; once none does, it's kept
+   among the idle ones for the next render to pick up, until they're too many
+   and the one idle for the longest is freed */
+struct HarmonicPlan {
+    WaveType type;
+    double freq;
+    uint32_t rate;
+    Harmonic *harmonics;
+    size_t count;
+    size_t refs; // renders holding it
+    struct HarmonicPlan *next; // in its bucket
+    struct HarmonicPlan *newer, *older; // among the idle plans
+};
+
+HarmonicPlan *harmonicPlanBuild(WaveType type, double freq, uint32_t rate)
+{
+    HarmonicPlan *plan = calloc(1, sizeof(*plan));
+    size_t cap = 16;
+    Harmonic *h = malloc(cap * sizeof(*h));
+    if (plan == NULL || h == NULL) {
+        ERR_OUT_OF_MEMORY();
+        exit(EXIT_FAILURE);
+    }
+
+    double factor = 1.0, sign = 1.0;
+    size_t count = 0;
+    while (type == WAVE_SINE ? count == 0 :
+        BELOW_NYQUIST(freq * factor, rate)) {
+        double amp = 1.0;
+        switch (type) {
+        case WAVE_TRIANGLE: amp = 1.0 / (factor * factor) * sign; break;
+        case WAVE_SQUARE: amp = 4.0 / (factor * PI); break;
+        case WAVE_SAW:
+        case WAVE_EVEN: amp = 1.0 / factor; break;
+        default: break;
+        }
+
+        if (count == cap) {
+            cap *= 2;
+            h = realloc(h, cap * sizeof(*h));
+            if (h == NULL) {
+                ERR_OUT_OF_MEMORY();
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        double w = 2.0 * PI * (freq * factor) / rate;
+        h[count++] = (Harmonic){
+            .freq = freq * factor,
+            .amp = amp,
+            .c = cos(w),
+            .s = sin(w),
+        };
+
+        sign = -sign;
+        if (type == WAVE_EVEN && factor == 1.0) factor = 0.0;
+
+        factor += type == WAVE_SAW ? 1.0 : 2.0;
+    }
+
+    plan->type = type;
+    plan->freq = freq;
+    plan->rate = rate;
+    plan->harmonics = h;
+    plan->count = count;
+    return plan;
+}
+
+/* the amount of harmonics addWave sums up for a tone */
+size_t harmonicPlanCount(const HarmonicPlan *plan)
+{
+    return plan->count;
+}
+
+void oscillatorAdd(double *buf, size_t start, size_t len, double freq,
+    uint32_t rate, double amp, OscillatorMode mode);
+double oscillatorPhaseAt(double freq, uint32_t rate, size_t i);
+
+/* harmonics rotated side by side, enough independent recurrences to hide the
+   latency of each one */
+#define HARMONIC_LANES 8
+
+/* adds 'lanes' (up to HARMONIC_LANES) harmonics to the 'len' samples of 'buf'
+   from sample 'n' on, which all fall within one resync interval; every
+   sample still gets them added one by one in plan order */
+static inline void harmonicsBlockAdd(double *buf, size_t len, size_t n,
+    const Harmonic *h, size_t lanes, uint32_t rate)
+{
+    double re[HARMONIC_LANES], im[HARMONIC_LANES];
+    double c[HARMONIC_LANES], s[HARMONIC_LANES], amp[HARMONIC_LANES];
+    for (size_t j = 0; j < lanes; j++) {
+        double phase = 2.0 * PI * oscillatorPhaseAt(h[j].freq, rate, n);
+        re[j] = cos(phase), im[j] = sin(phase);
+        c[j] = h[j].c, s[j] = h[j].s, amp[j] = h[j].amp;
+    }
+
+    if (lanes < HARMONIC_LANES) {
+        for (size_t i = 0; i < len; i++) {
+            for (size_t j = 0; j < lanes; j++) {
+                buf[i] += im[j] * amp[j];
+                double t = re[j] * c[j] - im[j] * s[j];
+                im[j] = re[j] * s[j] + im[j] * c[j];
+                re[j] = t;
+            }
+        }
+
+        return;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        double sum = buf[i];
+        for (size_t j = 0; j < HARMONIC_LANES; j++) sum += im[j] * amp[j];
+        buf[i] = sum;
+        for (size_t j = 0; j < HARMONIC_LANES; j++) {
+            double t = re[j] * c[j] - im[j] * s[j];
+            im[j] = re[j] * s[j] + im[j] * c[j];
+            re[j] = t;
+        }
+    }
+}
+
+/* adds a tone to 'buf' for samples in [start, start+len), one resync
+   interval at a time: every harmonic is summed into it while it sits in L1,
+   instead of streaming the whole buffer past each harmonic in turn */
+void addWave(double *buf, size_t start, size_t len, const HarmonicPlan *plan,
+    OscillatorMode osc)
+{
+    const Harmonic *h = plan->harmonics;
+    if (osc == OSC_LIBM) {
+        for (size_t k = 0; k < plan->count; k++) {
+            oscillatorAdd(buf, start, len, h[k].freq, plan->rate, h[k].amp,
+                osc);
+        }
+
+        return;
+    }
+
+    size_t i = 0;
+    while (i < len) {
+        size_t n = start + i;
+        size_t end = i + (OSC_RESYNC_INTERVAL - n % OSC_RESYNC_INTERVAL);
+        if (end > len) end = len;
+
+        for (size_t k = 0; k < plan->count; k += HARMONIC_LANES) {
+            size_t lanes = plan->count - k < HARMONIC_LANES ?
+                plan->count - k : HARMONIC_LANES;
+            harmonicsBlockAdd(buf + i, end - i, n, h + k, lanes, plan->rate);
+        }
+
+        i = end;
+    }
+}
+
+/* returns the phase of sample 'i' in cycles, within [0, 1) */
+double oscillatorPhaseAt(double freq, uint32_t rate, size_t i)
+{
+    /* splitting off the whole seconds keeps the product small enough for the
+       fractional part of the phase to survive in long renders */
+    double cycles = freq * (double)(i / rate);
+    cycles -= floor(cycles);
+    cycles += freq * (double)(i % rate) / rate;
+    return cycles - floor(cycles);
+}
+
+/* adds 'amp * sin(2pi * freq * n / rate)' to 'buf' for n in [start, start+len)
+   by rotating a unit phasor instead of calling sin() once per sample */
+void oscillatorAdd(double *buf, size_t start, size_t len, double freq,
+    uint32_t rate, double amp, OscillatorMode mode)
+{
+    if (mode == OSC_LIBM) {
+        for (size_t i = 0; i < len; i++) {
+            buf[i] += SINE_WAVE(freq, 1.0, rate, start + i) * amp;
+        }
+
+        return;
+    }
+
+    const double w = 2.0 * PI * freq / rate;
+    const double c = cos(w), s = sin(w);
+    size_t i = 0;
+    while (i < len) {
+        size_t n = start + i;
+        size_t end = i + (OSC_RESYNC_INTERVAL - n % OSC_RESYNC_INTERVAL);
+        if (end > len) end = len;
+
+        double phase = 2.0 * PI * oscillatorPhaseAt(freq, rate, n);
+        double re = cos(phase), im = sin(phase);
+        for (; i < end; i++) {
+            buf[i] += im * amp;
+            double t = re * c - im * s;
+            im = re * s + im * c;
+            re = t;
+        }
+    }
+}
+
+/* each octave of the mipmap holds the harmonics up to (2 << octave) - 1, and a
+   tone reads from the richest octave whose harmonics all stay below Nyquist */
+#define WAVETABLE_OCTAVES 15
+#define WAVETABLE_MIN_LEN 4096
+#define WAVETABLE_OVERSAMPLING 16
+#define WAVETABLE_GUARD 3
+
+typedef struct Wavetable {
+    double *octaves[WAVETABLE_OCTAVES];
+    size_t lens[WAVETABLE_OCTAVES];
+} Wavetable;
+
+/* shared by every render (and every batch job), which may ask for the same
+   table at the same time */
+static Wavetable wavetables[WAVE_EVEN + 1] = {0};
+static Mutex wavetableLock;
+
+/* as are the harmonic plans, hashed by tone */
+#define HARMONIC_PLAN_BUCKETS 1024
+#define HARMONIC_PLANS_IDLE_MAX 256
+
+typedef struct HarmonicPlanCache {
+    HarmonicPlan *buckets[HARMONIC_PLAN_BUCKETS];
+    HarmonicPlan *newest, *oldest; // idle
+    size_t idle;
+} HarmonicPlanCache;
+
+static HarmonicPlanCache harmonicPlans = {0};
+
+HarmonicPlan *harmonicPlanBuild(WaveType type, double freq, uint32_t rate);
+
+double harmonicAmp(WaveType type, size_t k);
+void fftInverse(double *re, double *im, size_t n);
+size_t wavetableOctaveIndex(double freq, uint32_t rate);
+
+/* value of a table 'len' points long at 'phase' (in cycles, within [0, 1)) */
+static inline double wavetableRead(const double *t, size_t len, double phase)
+{
+    double pos = phase * len;
+    size_t idx = (size_t)pos;
+    double x = pos - idx;
+    /* 4-point cubic hermite (catmull-rom) between t[idx+1] and t[idx+2],
+       since every table is prefixed with one wrapped guard point */
+    double y0 = t[idx], y1 = t[idx + 1], y2 = t[idx + 2], y3 = t[idx + 3];
+    double c1 = 0.5 * (y2 - y0);
+    double c2 = y0 - 2.5 * y1 + 2.0 * y2 - 0.5 * y3;
+    double c3 = 0.5 * (y3 - y0) + 1.5 * (y1 - y2);
+    return ((c3 * x + c2) * x + c1) * x + y1;
+}
+
+/* adds the band-limited wave of 'freq' read from its table 't' (as given by
+   wavetableOctaveFor) to 'buf' for samples in [start, start+len), with a cost
+   that doesn't depend on its harmonic count */
+void wavetableAdd(double *buf, size_t start, size_t len, const double *t,
+    size_t tableLen, double freq, uint32_t rate)
+{
+    const double inc = freq / rate;
+    size_t i = 0;
+    while (i < len) {
+        size_t n = start + i;
+        size_t end = i + (OSC_RESYNC_INTERVAL - n % OSC_RESYNC_INTERVAL);
+        if (end > len) end = len;
+
+        double phase = oscillatorPhaseAt(freq, rate, n);
+        for (; i < end; i++) {
+            buf[i] += wavetableRead(t, tableLen, phase);
+            phase += inc;
+            if (phase >= 1.0) phase -= 1.0;
+        }
+    }
+}
+
+/* a sweep's frequencies are kept in cycles per sample, and its length is the
+   wave's */
+typedef struct Sweep {
+    double f0, f1;
+    double len;
+    double efold; // samples per e-fold of frequency (exponential sweeps)
+    bool exponential;
+} Sweep;
+
+/* sweeps hold their octave for this many samples (a divisor of
+   OSC_RESYNC_INTERVAL), crossfading between neighbouring ones within it */
+#define SWEEP_CONTROL_LEN 64
+
+Sweep sweepMake(const Parameters *p)
+{
+    Sweep s = {
+        .f0 = p->sweepFreqs[0] / p->sampleRate,
+        .f1 = p->sweepFreqs[1] / p->sampleRate,
+        .len = (double)waveSampleCount(p),
+        .exponential = p->sweep == SWEEP_EXPONENTIAL,
+    };
+
+    if (s.exponential) s.efold = s.len / log(s.f1 / s.f0);
+    return s;
+}
+
+/* returns the phase of sample 'n' in cycles, within [0, 1): the integral of
+   a frequency that's either linear in time or in log-frequency (an ESS) */
+double sweepPhaseAt(const Sweep *s, size_t n)
+{
+    double cycles = s->exponential ?
+        s->f0 * s->efold * expm1(n / s->efold) :
+        s->f0 * n + (s->f1 - s->f0) * ((double)n * n) / (2.0 * s->len);
+    return cycles - floor(cycles);
+}
+
+/* cycles the phase advances by between sample 'n' and the next */
+double sweepIncrementAt(const Sweep *s, size_t n)
+{
+    if (s->exponential) {
+        return s->f0 * s->efold * exp(n / s->efold) * expm1(1.0 / s->efold);
+    }
+
+    return s->f0 + (s->f1 - s->f0) * (2.0 * n + 1.0) / (2.0 * s->len);
+}
+
+/* the frequency at sample 'n' (in cycles per sample), kept within the range
+   swept even past its end */
+double sweepFrequencyAt(const Sweep *s, size_t n)
+{
+    double lo = s->f0 < s->f1 ? s->f0 : s->f1;
+    double hi = s->f0 < s->f1 ? s->f1 : s->f0;
+    double freq = sweepIncrementAt(s, n);
+    return freq < lo ? lo : freq > hi ? hi : freq;
+}
+
+/* the octaves of the 'type' wavetable a sweep reads from */
+void sweepOctaves(const Parameters *p, WaveType type, size_t *first,
+    size_t *last)
+{
+    double lo = p->sweepFreqs[0], hi = p->sweepFreqs[1];
+    if (lo > hi) lo = p->sweepFreqs[1], hi = p->sweepFreqs[0];
+
+    *first = *last = 0;
+    if (type == WAVE_SINE) return;
+
+    *first = wavetableOctaveIndex(hi, p->sampleRate);
+    if (*first > 0) *first -= 1; // faded into towards the top of the range
+    *last = wavetableOctaveIndex(lo, p->sampleRate);
+}
+
+/* how far 'freq' (in cycles per sample) is through the range that reads from
+   'octave', from 0 where it starts to 1 where the next one up (which has half
+   the harmonics) takes over */
+double sweepBlend(double freq, size_t octave)
+{
+    if (octave == 0) return 0.0;
+
+    double lo = 0.5 / ((4u << octave) - 1), hi = 0.5 / ((2u << octave) - 1);
+    double x = log(freq / lo) / log(hi / lo);
+    return x < 0.0 ? 0.0 : x > 1.0 ? 1.0 : x;
+}
+
+/* adds the band-limited 'type' wave, swept from one frequency to the other
+   over the wave's duration, to 'buf' for samples in [start, start+len): the
+   phase is integrated one sample at a time (and resynced like an oscillator),
+   and every control block reads from the octave that fits its highest
+   frequency, faded into the next one up so that the harmonics roll off
+   smoothly instead of dropping out an octave at a time */
+void sweepAdd(double *buf, size_t start, size_t len, WaveType type,
+    const Parameters *p)
+{
+    const Sweep s = sweepMake(p);
+    /* the increment grows by a constant step, or by a constant ratio */
+    const double step = s.exponential ? 0.0 : (s.f1 - s.f0) / s.len;
+    const double ratio = s.exponential ? exp(1.0 / s.efold) : 1.0;
+    const double *tables[WAVETABLE_OCTAVES] = {0};
+    size_t tableLens[WAVETABLE_OCTAVES] = {0};
+    double phase = 0.0, inc = 0.0;
+    size_t i = 0;
+    while (i < len) {
+        size_t n = start + i;
+        size_t block = n - n % SWEEP_CONTROL_LEN;
+        size_t end = i + (block + SWEEP_CONTROL_LEN - n);
+        if (end > len) end = len;
+        if (i == 0 || n % OSC_RESYNC_INTERVAL == 0) {
+            phase = sweepPhaseAt(&s, n);
+            inc = sweepIncrementAt(&s, n);
+        }
+
+        double fa = sweepFrequencyAt(&s, block);
+        double fb = sweepFrequencyAt(&s, block + SWEEP_CONTROL_LEN);
+        size_t octave = type == WAVE_SINE ? 0 :
+            wavetableOctaveIndex((fa > fb ? fa : fb) * p->sampleRate,
+                p->sampleRate);
+        double xa = sweepBlend(fa, octave), xb = sweepBlend(fb, octave);
+        double dx = (xb - xa) / SWEEP_CONTROL_LEN;
+        double x = xa + dx * (n - block);
+
+        size_t next = octave > 0 && (xa > 0.0 || xb > 0.0) ? octave - 1 :
+            octave;
+        for (size_t o = next; o <= octave; o++) {
+            if (tables[o] != NULL) continue;
+
+            tables[o] = wavetableOctave(type, o, &tableLens[o]);
+        }
+
+        const double *t = tables[octave], *u = tables[next];
+        const size_t tLen = tableLens[octave], uLen = tableLens[next];
+        for (; i < end; i++) {
+            double y = wavetableRead(t, tLen, phase);
+            if (u != t) y += x * (wavetableRead(u, uLen, phase) - y);
+
+            buf[i] += y;
+            x += dx;
+            phase += inc;
+            if (phase >= 1.0) phase -= 1.0;
+            inc = inc * ratio + step;
+        }
+    }
+}
+
+const double *wavetableOctaveFor(WaveType type, double freq, uint32_t rate,
+    size_t *len)
+{
+    return wavetableOctave(type, wavetableOctaveIndex(freq, rate), len);
+}
+
+size_t wavetableOctaveIndex(double freq, uint32_t rate)
+{
+    double nyquist = rate / 2.0;
+    size_t harmonics = (size_t)ceil(nyquist / freq) - 1;
+    size_t octave = 0;
+    while (octave + 1 < WAVETABLE_OCTAVES && (4u << octave) - 1 <= harmonics) {
+        octave += 1;
+    }
+
+    return octave;
+}
+
+const double *wavetableOctave(WaveType type, size_t octave, size_t *len)
+{
+    Wavetable *w = &wavetables[type];
+    size_t maxHarmonic = (2u << octave) - 1;
+    mutexLock(&wavetableLock);
+    if (w->octaves[octave] != NULL) {
+        *len = w->lens[octave];
+        mutexUnlock(&wavetableLock);
+        return w->octaves[octave];
+    }
+
+    size_t n = WAVETABLE_MIN_LEN;
+    while (n < WAVETABLE_OVERSAMPLING * (maxHarmonic + 1)) n *= 2;
+
+    double *re = calloc(n, sizeof(*re));
+    double *im = calloc(n, sizeof(*im));
+    double *table = malloc((n + WAVETABLE_GUARD) * sizeof(*table));
+    if (re == NULL || im == NULL || table == NULL) {
+        ERR_OUT_OF_MEMORY();
+        exit(EXIT_FAILURE);
+    }
+
+    /* the imaginary part of the inverse DFT of the harmonic amplitudes is
+       exactly the sum of their sines over one period */
+    for (size_t k = 1; k <= maxHarmonic; k++) re[k] = harmonicAmp(type, k);
+    fftInverse(re, im, n);
+
+    table[0] = im[n - 1];
+    memcpy(table + 1, im, n * sizeof(*table));
+    table[n + 1] = im[0];
+    table[n + 2] = im[1];
+
+    free(re);
+    free(im);
+    w->octaves[octave] = table;
+    w->lens[octave] = n;
+    mutexUnlock(&wavetableLock);
+    *len = n;
+    return table;
+}
+
+HarmonicPlan **harmonicPlanBucket(WaveType type, double freq, uint32_t rate)
+{
+    uint64_t bits = 0;
+    memcpy(&bits, &freq, sizeof(bits));
+    uint64_t h = bits ^ ((uint64_t)rate << 32) ^ type;
+    h *= 0x9E3779B97F4A7C15ULL;
+    return &harmonicPlans.buckets[(h >> 32) % HARMONIC_PLAN_BUCKETS];
+}
+
+/* takes 'plan' off the idle list (harmonicPlanIdle puts it at its newest
+   end) */
+void harmonicPlanUnidle(HarmonicPlan *plan)
+{
+    HarmonicPlanCache *c = &harmonicPlans;
+    *(plan->newer != NULL ? &plan->newer->older : &c->newest) = plan->older;
+    *(plan->older != NULL ? &plan->older->newer : &c->oldest) = plan->newer;
+    plan->newer = plan->older = NULL;
+    c->idle -= 1;
+}
+
+void harmonicPlanIdle(HarmonicPlan *plan)
+{
+    HarmonicPlanCache *c = &harmonicPlans;
+    plan->older = c->newest;
+    *(c->newest != NULL ? &c->newest->newer : &c->oldest) = plan;
+    c->newest = plan;
+    c->idle += 1;
+}
+
+void harmonicPlanFree(HarmonicPlan *plan)
+{
+    HarmonicPlan **link = harmonicPlanBucket(plan->type, plan->freq,
+        plan->rate);
+    while (*link != plan) link = &(*link)->next;
+    *link = plan->next;
+    free(plan->harmonics);
+    free(plan);
+}
+
+/* the plan of a tone, held until it's given back to harmonicPlanRelease */
+const HarmonicPlan *harmonicPlanFor(WaveType type, double freq, uint32_t rate)
+{
+    mutexLock(&wavetableLock);
+    HarmonicPlan **bucket = harmonicPlanBucket(type, freq, rate);
+    HarmonicPlan *plan = *bucket;
+    while (plan != NULL && (plan->type != type || plan->freq != freq ||
+        plan->rate != rate)) {
+        plan = plan->next;
+    }
+
+    if (plan == NULL) {
+        plan = harmonicPlanBuild(type, freq, rate);
+        plan->next = *bucket;
+        *bucket = plan;
+    } else if (plan->refs == 0) {
+        harmonicPlanUnidle(plan);
+    }
+
+    plan->refs += 1;
+    mutexUnlock(&wavetableLock);
+    return plan;
+}
+
+void harmonicPlanRelease(const HarmonicPlan *plan)
+{
+    mutexLock(&wavetableLock);
+    HarmonicPlan *held = (HarmonicPlan*)plan;
+    held->refs -= 1;
+    if (held->refs == 0) harmonicPlanIdle(held);
+
+    if (harmonicPlans.idle > HARMONIC_PLANS_IDLE_MAX) {
+        HarmonicPlan *oldest = harmonicPlans.oldest;
+        harmonicPlanUnidle(oldest);
+        harmonicPlanFree(oldest);
+    }
+
+    mutexUnlock(&wavetableLock);
+}
+
+void wavetablesInit(void)
+{
+    mutexInit(&wavetableLock);
+}
+
+void wavetablesDestroy(void)
+{
+    for (size_t i = 0; i <= WAVE_EVEN; i++) {
+        for (size_t j = 0; j < WAVETABLE_OCTAVES; j++) {
+            free(wavetables[i].octaves[j]);
+        }
+    }
+
+    for (size_t i = 0; i < HARMONIC_PLAN_BUCKETS; i++) {
+        while (harmonicPlans.buckets[i] != NULL) {
+            harmonicPlanFree(harmonicPlans.buckets[i]);
+        }
+    }
+
+    memset(&harmonicPlans, 0, sizeof(harmonicPlans));
+
+    memset(wavetables, 0, sizeof(wavetables));
+    mutexDestroy(&wavetableLock);
+}
+
+/* amplitude (and sign) of the k-th harmonic of each wave type, matching the
+   series summed by addWave */
+double harmonicAmp(WaveType type, size_t k)
+{
+    switch (type) {
+    case WAVE_SINE:
+        return k == 1 ? 1.0 : 0.0;
+    case WAVE_TRIANGLE:
+        if (k % 2 == 0) return 0.0;
+        return (k % 4 == 1 ? 1.0 : -1.0) / ((double)k * k);
+    case WAVE_SQUARE:
+        return k % 2 ? 4.0 / (k * PI) : 0.0;
+    case WAVE_SAW:
+        return 1.0 / k;
+    case WAVE_EVEN:
+        return (k == 1 || k % 2 == 0) ? 1.0 / k : 0.0;
+    case WAVE_WHITE_NOISE:
+    case WAVE_PINK_NOISE:
+    case WAVE_BROWN_NOISE:
+    case WAVE_BAND_NOISE:
+        return 0.0;
+    }
+
+    return 0.0;
+}
+
+/* in-place, unnormalized radix-2 DFT with a positive exponent ('n' must be a
+   power of two) */
+void fftInverse(double *re, double *im, size_t n)
+{
+    for (size_t i = 1, j = 0; i < n; i++) {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) {
+            double t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+
+    for (size_t len = 2; len <= n; len <<= 1) {
+        const double step = 2.0 * PI / len;
+        for (size_t k = 0; k < len / 2; k++) {
+            const double wr = cos(step * k), wi = sin(step * k);
+            for (size_t i = k; i < n; i += len) {
+                size_t j = i + len / 2;
+                double vr = re[j] * wr - im[j] * wi;
+                double vi = re[j] * wi + im[j] * wr;
+                re[j] = re[i] - vr, im[j] = im[i] - vi;
+                re[i] += vr, im[i] += vi;
+            }
+        }
+    }
+}
+
+/* tones with more harmonics than this (below about 'rate / 2^17' Hz) have
+   their peak searched for instead of predicted */
+#define PEAK_MAX_HARMONICS (64 * KB)
+#define PEAK_NEWTON_STEPS 4
+/* in auto mode, the peak gets predicted once searching for it would render
+   more than 1/PEAK_SCAN_SHARE of the wave's samples on top of the wave */
+#define PEAK_SCAN_SHARE 8
+
+/* peak magnitude of the series summing the first 'harmonics' harmonics of the
+   'type' wave, between samples too (so no sample can exceed it): read off an
+   oversampled period, then refined by a few newton steps on the series */
+double seriesPeak(WaveType type, size_t harmonics)
+{
+    if (type == WAVE_SINE) return 1.0;
+
+    size_t n = WAVETABLE_MIN_LEN;
+    while (n < WAVETABLE_OVERSAMPLING * (harmonics + 1)) n *= 2;
+
+    double *re = calloc(n, sizeof(*re));
+    double *im = calloc(n, sizeof(*im));
+    if (re == NULL || im == NULL) {
+        ERR_OUT_OF_MEMORY();
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t k = 1; k <= harmonics; k++) re[k] = harmonicAmp(type, k);
+    fftInverse(re, im, n);
+
+    size_t top = 0;
+    for (size_t i = 1; i < n; i++) {
+        if (fabs(im[i]) > fabs(im[top])) top = i;
+    }
+
+    double peak = fabs(im[top]);
+    double x = (double)top / n;
+    free(re);
+    free(im);
+
+    for (size_t step = 0; step <= PEAK_NEWTON_STEPS; step++) {
+        double y = 0.0, dy = 0.0, ddy = 0.0;
+        for (size_t k = 1; k <= harmonics; k++) {
+            double a = harmonicAmp(type, k), w = 2.0 * PI * k;
+            if (a == 0.0) continue;
+
+            double s = sin(w * x), c = cos(w * x);
+            y += a * s, dy += a * w * c, ddy -= a * w * w * s;
+        }
+
+        if (fabs(y) > peak) peak = fabs(y);
+        if (step == PEAK_NEWTON_STEPS || ddy == 0.0) break;
+
+        /* the grid already puts the top within half a step */
+        double dx = -dy / ddy;
+        if (fabs(dx) > 0.5 / n) dx = dx > 0.0 ? 0.5 / n : -0.5 / n;
+        x += dx;
+    }
+
+    return peak;
+}
+
+/* peak of a single tone as it gets rendered (out of the harmonics addWave
+   sums up, or those of the wavetable octave it reads from), or -1 if it has
+   too many harmonics to predict it */
+double tonePeak(const Parameters *p, WaveType type, double freq)
+{
+    size_t harmonics = 0;
+    if (type == WAVE_SINE) return 1.0;
+
+    if (p->synthesis == SYNTH_WAVETABLE) {
+        harmonics = (2u << wavetableOctaveIndex(freq, p->sampleRate)) - 1;
+    } else {
+        while (harmonics <= PEAK_MAX_HARMONICS &&
+            BELOW_NYQUIST(freq * (harmonics + 1), p->sampleRate)) {
+            harmonics += 1;
+        }
+    }
+
+    return harmonics > PEAK_MAX_HARMONICS ? -1.0 : seriesPeak(type, harmonics);
+}
+
+/* upper bound on the peak of a sweep: the highest of the octaves it reads
+   from, since a crossfade between two of them can't exceed either (and every
+   octave gets read on its own wherever the sweep enters its range) */
+double sweepPeak(const Parameters *p, WaveType type)
+{
+    size_t first = 0, last = 0;
+    sweepOctaves(p, type, &first, &last);
+
+    double peak = 0.0;
+    for (size_t o = first; o <= last; o++) {
+        double octave = seriesPeak(type, (2u << o) - 1);
+        if (octave > peak) peak = octave;
+    }
+
+    return peak;
+}
+
+/* upper bound on the peak of a channel's raw tone set: exact for a single
+   tone, and the sum of the tone peaks for several, which is where the wave
+   peaks once its tones line up (and what it gets arbitrarily close to when
+   they share no short period); false if a tone can't be predicted */
+bool channelPeakBound(const Parameters *p, const Channel *ch, double *peak)
+{
+    *peak = 0.0;
+    if (waveIsNoise(ch->waveType)) {
+        *peak = noisePeakBound(p, ch->waveType);
+        return true;
+    }
+
+    if (p->sweep != SWEEP_NONE) {
+        *peak = sweepPeak(p, ch->waveType);
+        return true;
+    }
+
+    for (size_t i = 0; i < ch->freqCount; i++) {
+        double tone = tonePeak(p, ch->waveType, ch->freqs[i]);
+        if (tone < 0.0) return false;
+
+        *peak += tone;
+    }
+
+    return true;
+}
+
+/* fills in every channel's gain from its predicted peak instead of searching
+   the wave for it, which analytic mode always does and auto mode does once
+   the search would render 'scanLen' samples that aren't part of the 'total'
+   (when it isn't worth it for harmonically related tones, whose true peak
+   can be well below the bound, the period is short enough to search); the
+   bound on white noise is as good as its peak, but those on filtered noise
+   are loose enough that auto mode searches for theirs */
+bool peakPredict(const Parameters *p, size_t scanLen, size_t total,
+    double gains[MAX_CHANNELS])
+{
+    if (p->peakMode == PEAK_EXACT) return false;
+    if (p->peakMode == PEAK_AUTO && scanLen <= total / PEAK_SCAN_SHARE) {
+        return false;
+    }
+
+    for (size_t c = 0; c < p->channelCount; c++) {
+        WaveType type = p->channels[c].waveType;
+        if (!waveIsNoise(type) || type == WAVE_WHITE_NOISE) continue;
+        if (p->peakMode == PEAK_ANALYTIC) continue;
+
+        loggerAppend(LOG_INFO, "channel %zu is filtered noise, whose peak is "
+            "only loosely bounded (searching for it instead)", c + 1);
+        return false;
+    }
+
+    double begin = spanBegin();
+    for (size_t c = 0; c < p->channelCount; c++) {
+        const Channel *ch = &p->channels[c];
+        double peak = 0.0;
+        if (!channelPeakBound(p, ch, &peak)) {
+            loggerAppend(LOG_INFO, "channel %zu has a tone too low for its "
+                "peak to be predicted, searching for it instead", c + 1);
+            spanEnd(SPAN_PEAK, begin);
+            return false;
+        }
+
+        gains[c] = decibelsToGain(ch->amplitude) / peak;
+    }
+
+    spanEnd(SPAN_PEAK, begin);
+    loggerAppend(LOG_INFO, "predicted the wave's peak instead of searching "
+        "for it");
+    return true;
+}
+
+#define LSB_24_BIT (1.0 / 8388607.0)
+
+/* compares the first channel's tones as summed by the recurrence oscillator
+   against libm, which says nothing of noise (there is no oscillator behind
+   it) and leaves out a sweep (which is read from wavetables) */
+void oscillatorAccuracyReport(const Parameters *p)
+{
+    const Channel *ch = &p->channels[0];
+    if (waveIsNoise(ch->waveType)) {
+        loggerAppend(ERR_ARG, "channel 1 is noise, which has no oscillator to"
+            " measure the accuracy of (skipping it)");
+        return;
+    }
+
+    size_t len = p->sampleRate; // one second worth of samples
+    double *ref = calloc(len, sizeof(*ref));
+    double *fast = calloc(len, sizeof(*fast));
+    if (ref == NULL || fast == NULL) {
+        ERR_OUT_OF_MEMORY();
+        exit(EXIT_FAILURE);
+    }
+
+    loggerAppend(LOG_INFO, "measuring oscillator accuracy against libm");
+    if (p->sweep != SWEEP_NONE) {
+        loggerAppend(LOG_INFO, "(on channel 1's ToneFrequencies, not on the"
+            " sweep, which is read from wavetables)");
+    }
+    for (size_t i = 0; i < ch->freqCount; i++) {
+        const HarmonicPlan *plan = harmonicPlanFor(ch->waveType, ch->freqs[i],
+            p->sampleRate);
+        addWave(ref, 0, len, plan, OSC_LIBM);
+        addWave(fast, 0, len, plan, OSC_RECURRENCE);
+        harmonicPlanRelease(plan);
+    }
+
+    double peak = 0.0, maxErr = 0.0;
+    for (size_t i = 0; i < len; i++) {
+        double err = fabs(fast[i] - ref[i]);
+        if (fabs(ref[i]) > peak) peak = fabs(ref[i]);
+        if (err > maxErr) maxErr = err;
+    }
+
+    /* the error is measured relative to a full-scale (0dBFS) normalization */
+    double relErr = peak > 0.0 ? maxErr / peak : 0.0;
+    loggerAppend(LOG_INFO,
+        "* Max Error:     %.3e (%.1lfdBFS) over %zu samples",
+        relErr, relErr > 0.0 ? 20.0 * log10(relErr) : -HUGE_VAL, len);
+    loggerAppend(LOG_INFO,
+        "* 24-bit LSB:    %.3e (%s)", LSB_24_BIT,
+        relErr < LSB_24_BIT ? "error is below it" : "error EXCEEDS it");
+
+    free(ref);
+    free(fast);
+}
+
+void applyDither(const Parameters *p, size_t channel, void *buf,
+    size_t start, size_t len, double gain);
+void quantizeBuffer(const Parameters *p, const void *src, size_t plane,
+    const double *gains, void *dst, size_t len);
+
+/* generates the base chunk, which is left for the quantizer to normalize
+   unless it's dithered (which normalizes it on the way) */
+WaveChunk waveChunkPrepare(const Parameters *p)
+{
+    loggerAppend(LOG_INFO, "generating base wave(s) (looping every %zu samples)",
+        waveChunkLength(p));
+    WaveChunk w = waveChunkGenerate(p);
+    if (p->sampleFormat == FMT_INT_PCM && p->applyDither) {
+        loggerAppend(LOG_INFO, "applying %u-bit TPDF dither",
+            p->bitsPerSample);
+        for (size_t c = 0; c < w.channelCount; c++) {
+            applyDither(p, c, sampleAt(p, w.buf, c * w.plane), 0,
+                w.sampleCount, w.gains[c]);
+            w.gains[c] = 1.0;
+        }
+    }
+
+    if (p->sampleFormat == FMT_INT_PCM) {
+        loggerAppend(LOG_INFO, "truncating to %u-bit integer",
+            p->bitsPerSample);
+    }
+
+    return w;
+}
+
+AudioBuffer audioBufferBuild(const Parameters *p)
+{
+    WaveChunk w = waveChunkPrepare(p);
+    size_t len = w.sampleCount;
+    size_t channels = w.channelCount;
+    size_t bits = p->bitsPerSample;
+    size_t bytes = bits / 8, unused = 0;
+
+    /* 64-bit mono samples only need to be scaled, which can be done in place */
+    bool inPlace = bits == 64 && channels == 1;
+    void *buf = inPlace ? w.buf : samplesAlloc(len * channels * bytes, 1, 1,
+        &unused);
+
+    quantizeBuffer(p, w.buf, w.plane, w.gains, buf, len);
+    if (!inPlace) samplesFree(w.buf);
+    if (machineIsBigEndian()) convertToLittleEndian(buf, len * channels, bits);
+
+    return (AudioBuffer){
+        .buf = buf,
+        .sampleCount = len,
+        .bytesPerFrame = channels * bytes,
+    };
+}
+
+typedef struct QuantizeJob {
+    const Parameters *p;
+    const void *src;
+    size_t plane;
+    const double *gains;
+    void *dst;
+} QuantizeJob;
+
+void quantizeTile(void *ctx, size_t tile, size_t start, size_t len);
+
+/* quantizes 'len' frames of the planar 'src' (whose channels start 'plane'
+   samples apart) into interleaved PCM, scaling each channel by its entry of
+   'gains' on the way (unless it's NULL) */
+void quantizeBuffer(const Parameters *p, const void *src, size_t plane,
+    const double *gains, void *dst, size_t len)
+{
+    double begin = spanBegin();
+    QuantizeJob job = {
+        .p = p,
+        .src = src,
+        .plane = plane,
+        .gains = gains,
+        .dst = dst,
+    };
+
+    parallelFor(len, quantizeTile, &job);
+    spanEnd(SPAN_QUANTIZE, begin);
+}
+
+typedef struct QuantizeSpec {
+    SampleFormat format;
+    size_t bits;
+    double scale, offset; // applied as 'x * scale + offset' (float: 'x * scale')
+    double lo, hi; // saturation limits (before rounding)
+} QuantizeSpec;
+
+/* kernels write a sample every 'stride' samples of 'dst', which is how the
+   channels get interleaved */
+typedef void (*QuantizeKernel)(const double *src, void *dst, size_t len,
+    size_t stride, const QuantizeSpec *q);
+
+/* float samples only ever get quantized to 8/16/24-bit integers or 32-bit
+   floats, which their 24-bit mantissa still covers */
+typedef void (*QuantizeFloatKernel)(const float *src, void *dst, size_t len,
+    size_t stride, const QuantizeSpec *q);
+
+void quantizeScalar(const double *src, void *dst, size_t len, size_t stride,
+    const QuantizeSpec *q);
+void quantizeFloatScalar(const float *src, void *dst, size_t len,
+    size_t stride, const QuantizeSpec *q);
+
+static QuantizeKernel quantizeKernel = quantizeScalar;
+static QuantizeFloatKernel quantizeFloatKernel = quantizeFloatScalar;
+
+QuantizeSpec quantizeSpecMake(SampleFormat fmt, size_t bits)
+{
+    QuantizeSpec q = { .format = fmt, .bits = bits, .scale = 1.0 };
+    if (fmt == FMT_INT_PCM) {
+        q.scale = pow(2.0, bits - 1.0) - 1.0;
+        q.lo = -q.scale - 1.0, q.hi = q.scale;
+        if (bits == 8) { // 8-bit PCM is unsigned
+            q.offset = INT8_MAX + 1;
+            q.lo = 0.0, q.hi = UINT8_MAX;
+        }
+    }
+
+    return q;
+}
+
+#define QUANTIZE_BLOCK_LEN 1024
+
+void quantizeTile(void *ctx, size_t tile, size_t start, size_t len)
+{
+    (void)tile;
+    const QuantizeJob *job = ctx;
+    const Parameters *p = job->p;
+    size_t bits = p->bitsPerSample;
+    size_t channels = p->channelCount;
+    size_t frameBytes = channels * (bits / 8);
+    uint8_t *dst = (uint8_t*)job->dst + start * frameBytes;
+    /* the channel's gain is folded into the scale, which normalizes it
+       without a pass of its own */
+    QuantizeSpec q[MAX_CHANNELS];
+    for (size_t c = 0; c < channels; c++) {
+        q[c] = quantizeSpecMake(p->sampleFormat, bits);
+        if (job->gains != NULL) q[c].scale *= job->gains[c];
+    }
+
+    /* 64-bit samples are only ever copied (or scaled), which needs no vector
+       kernel */
+    QuantizeKernel kernel = bits == 64 ? quantizeScalar : quantizeKernel;
+    bool single = samplePrecision(p) == PRECISION_FLOAT;
+
+    /* the channels are interleaved a short run of frames at a time, so the
+       output they share stays in cache until every channel is in */
+    for (size_t i = 0; i < len; i += QUANTIZE_BLOCK_LEN) {
+        size_t n = len - i < QUANTIZE_BLOCK_LEN ? len - i : QUANTIZE_BLOCK_LEN;
+        for (size_t c = 0; c < channels; c++) {
+            size_t at = c * job->plane + start + i;
+            uint8_t *out = dst + i * frameBytes + c * (bits / 8);
+            if (single) {
+                quantizeFloatKernel((const float*)job->src + at, out, n,
+                    channels, &q[c]);
+            } else {
+                kernel((const double*)job->src + at, out, n, channels, &q[c]);
+            }
+        }
+    }
+}
+
+/* every kernel rounds to nearest-even (the default rounding mode, which is
+   what the vector conversions use) and saturates instead of wrapping around,
+   so they all produce the exact same output */
+static inline int32_t quantizeSample(double x, const QuantizeSpec *q)
+{
+    x = x * q->scale + q->offset;
+    x = x < q->lo ? q->lo : (x > q->hi ? q->hi : x);
+    return (int32_t)lrint(x);
+}
+
+static inline void storeInt24(uint8_t *dst, int32_t val)
+{
+    dst[0] = (uint8_t)val;
+    dst[1] = (uint8_t)(val >> 8);
+    dst[2] = (uint8_t)(val >> 16);
+}
+
+/* stores 'count' (already saturated) samples 'step' bytes apart */
+static inline void storeStrided(uint8_t *out, const int32_t *lanes,
+    size_t count, size_t step, size_t bits)
+{
+    for (size_t j = 0; j < count; j++, out += step) {
+        switch (bits) {
+        case 8: {
+            *out = (uint8_t)lanes[j];
+        } break;
+        case 16: {
+            int16_t val = (int16_t)lanes[j];
+            memcpy(out, &val, sizeof(val));
+        } break;
+        case 24: {
+            storeInt24(out, lanes[j]);
+        } break;
+        case 32: {
+            memcpy(out, &lanes[j], sizeof(lanes[j]));
+        } break;
+        }
+    }
+}
+
+static inline void storeStridedFloat(uint8_t *out, const float *lanes,
+    size_t count, size_t step)
+{
+    for (size_t j = 0; j < count; j++, out += step) {
+        memcpy(out, &lanes[j], sizeof(lanes[j]));
+    }
+}
+
+void quantizeScalar(const double *src, void *dst, size_t len, size_t stride,
+    const QuantizeSpec *q)
+{
+    uint8_t *out = dst;
+    const size_t step = stride * (q->bits / 8);
+    if (q->format == FMT_FLOAT_PCM && q->bits == 64) {
+        if (stride == 1 && q->scale == 1.0) {
+            if ((const void*)out != src) memcpy(out, src, len * sizeof(*src));
+            return;
+        }
+
+        /* 'dst' may be 'src' itself */
+        for (size_t i = 0; i < len; i++, out += step) {
+            double val = src[i] * q->scale;
+            memcpy(out, &val, sizeof(val));
+        }
+
+        return;
+    }
+
+    if (q->format == FMT_FLOAT_PCM) {
+        for (size_t i = 0; i < len; i++, out += step) {
+            float val = (float)(src[i] * q->scale);
+            memcpy(out, &val, sizeof(val));
+        }
+
+        return;
+    }
+
+    switch (q->bits) {
+    case 8: {
+        for (size_t i = 0; i < len; i++, out += step) {
+            *out = (uint8_t)quantizeSample(src[i], q);
+        }
+    } break;
+    case 16: {
+        for (size_t i = 0; i < len; i++, out += step) {
+            int16_t val = (int16_t)quantizeSample(src[i], q);
+            memcpy(out, &val, sizeof(val));
+        }
+    } break;
+    case 24: {
+        for (size_t i = 0; i < len; i++, out += step) {
+            storeInt24(out, quantizeSample(src[i], q));
+        }
+    } break;
+    case 32: {
+        for (size_t i = 0; i < len; i++, out += step) {
+            int32_t val = quantizeSample(src[i], q);
+            memcpy(out, &val, sizeof(val));
+        }
+    } break;
+    }
+}
+
+void quantizeFloatScalar(const float *src, void *dst, size_t len,
+    size_t stride, const QuantizeSpec *q)
+{
+    uint8_t *out = dst;
+    const size_t step = stride * (q->bits / 8);
+    const float scale = (float)q->scale;
+    if (q->format == FMT_FLOAT_PCM) {
+        for (size_t i = 0; i < len; i++, out += step) {
+            float val = src[i] * scale;
+            memcpy(out, &val, sizeof(val));
+        }
+
+        return;
+    }
+
+    const float offset = (float)q->offset;
+    const float lo = (float)q->lo, hi = (float)q->hi;
+    for (size_t i = 0; i < len; i++, out += step) {
+        float x = src[i] * scale + offset;
+        x = x < lo ? lo : (x > hi ? hi : x);
+        int32_t val = (int32_t)lrintf(x);
+        storeStrided(out, &val, 1, step, q->bits);
+    }
+}
+
+#if defined SIMD_X86
+/* stores 4 (already saturated) int32 samples in the output's PCM format,
+   'step' bytes apart */
+__attribute__((target("sse2")))
+static inline void storePcm4(uint8_t *out, __m128i v, size_t step,
+    size_t bits)
+{
+    if (step != bits / 8) {
+        int32_t lanes[4];
+        _mm_storeu_si128((__m128i*)lanes, v);
+        storeStrided(out, lanes, 4, step, bits);
+        return;
+    }
+
+    switch (bits) {
+    case 8: {
+        __m128i w = _mm_packs_epi32(v, v);
+        int32_t packed = _mm_cvtsi128_si32(_mm_packus_epi16(w, w));
+        memcpy(out, &packed, sizeof(packed));
+    } break;
+    case 16: {
+        _mm_storel_epi64((__m128i*)out, _mm_packs_epi32(v, v));
+    } break;
+    case 24: {
+        int32_t lanes[4];
+        _mm_storeu_si128((__m128i*)lanes, v);
+        for (size_t j = 0; j < 4; j++) storeInt24(out + j * 3, lanes[j]);
+    } break;
+    case 32: {
+        _mm_storeu_si128((__m128i*)out, v);
+    } break;
+    }
+}
+
+__attribute__((target("sse2")))
+void quantizeSse2(const double *src, void *dst, size_t len, size_t stride,
+    const QuantizeSpec *q)
+{
+    size_t i = 0;
+    const size_t step = stride * (q->bits / 8);
+    if (q->format == FMT_FLOAT_PCM) {
+        const __m128d scale = _mm_set1_pd(q->scale);
+        for (; i + 4 <= len; i += 4) {
+            __m128 lo = _mm_cvtpd_ps(_mm_mul_pd(_mm_loadu_pd(src + i), scale));
+            __m128 hi = _mm_cvtpd_ps(
+                _mm_mul_pd(_mm_loadu_pd(src + i + 2), scale));
+            if (stride == 1) {
+                _mm_storeu_ps((float*)dst + i, _mm_movelh_ps(lo, hi));
+            } else {
+                float lanes[4];
+                _mm_storeu_ps(lanes, _mm_movelh_ps(lo, hi));
+                storeStridedFloat((uint8_t*)dst + i * step, lanes, 4, step);
+            }
+        }
+
+        quantizeScalar(src + i, (uint8_t*)dst + i * step, len - i, stride, q);
+        return;
+    }
+
+    const __m128d scale = _mm_set1_pd(q->scale);
+    const __m128d offset = _mm_set1_pd(q->offset);
+    const __m128d lo = _mm_set1_pd(q->lo), hi = _mm_set1_pd(q->hi);
+    for (; i + 4 <= len; i += 4) {
+        __m128d a = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(src + i), scale), offset);
+        __m128d b = _mm_add_pd(
+            _mm_mul_pd(_mm_loadu_pd(src + i + 2), scale), offset);
+        a = _mm_min_pd(_mm_max_pd(a, lo), hi);
+        b = _mm_min_pd(_mm_max_pd(b, lo), hi);
+        __m128i v = _mm_unpacklo_epi64(_mm_cvtpd_epi32(a), _mm_cvtpd_epi32(b));
+        storePcm4((uint8_t*)dst + i * step, v, step, q->bits);
+    }
+
+    quantizeScalar(src + i, (uint8_t*)dst + i * step, len - i, stride, q);
+}
+
+__attribute__((target("sse2")))
+void quantizeFloatSse2(const float *src, void *dst, size_t len,
+    size_t stride, const QuantizeSpec *q)
+{
+    size_t i = 0;
+    const size_t step = stride * (q->bits / 8);
+    const __m128 scale = _mm_set1_ps((float)q->scale);
+    if (q->format == FMT_FLOAT_PCM) {
+        for (; i + 4 <= len; i += 4) {
+            __m128 v = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+            if (stride == 1) {
+                _mm_storeu_ps((float*)dst + i, v);
+            } else {
+                float lanes[4];
+                _mm_storeu_ps(lanes, v);
+                storeStridedFloat((uint8_t*)dst + i * step, lanes, 4, step);
+            }
+        }
+
+        quantizeFloatScalar(src + i, (uint8_t*)dst + i * step, len - i,
+            stride, q);
+        return;
+    }
+
+    const __m128 offset = _mm_set1_ps((float)q->offset);
+    const __m128 lo = _mm_set1_ps((float)q->lo);
+    const __m128 hi = _mm_set1_ps((float)q->hi);
+    for (; i + 4 <= len; i += 4) {
+        __m128 a = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + i), scale), offset);
+        a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+        storePcm4((uint8_t*)dst + i * step, _mm_cvtps_epi32(a), step, q->bits);
+    }
+
+    quantizeFloatScalar(src + i, (uint8_t*)dst + i * step, len - i, stride,
+        q);
+}
+
+/* packs the low 3 bytes of each of the 4 int32 lanes into 12 bytes */
+__attribute__((target("avx2")))
+static inline void storeInt24x4(uint8_t *dst, __m128i v)
+{
+    const __m128i shuffle = _mm_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    v = _mm_shuffle_epi8(v, shuffle);
+    _mm_storel_epi64((__m128i*)dst, v);
+    int32_t tail = _mm_extract_epi32(v, 2);
+    memcpy(dst + 8, &tail, sizeof(tail));
+}
+
+/* stores 8 (already saturated) int32 samples in the output's PCM format,
+   'step' bytes apart */
+__attribute__((target("avx2")))
+static inline void storePcm8(uint8_t *out, __m128i a, __m128i b, size_t step,
+    size_t bits)
+{
+    if (step != bits / 8) {
+        int32_t lanes[8];
+        _mm_storeu_si128((__m128i*)lanes, a);
+        _mm_storeu_si128((__m128i*)lanes + 1, b);
+        storeStrided(out, lanes, 8, step, bits);
+        return;
+    }
+
+    switch (bits) {
+    case 8: {
+        __m128i w = _mm_packs_epi32(a, b);
+        _mm_storel_epi64((__m128i*)out, _mm_packus_epi16(w, w));
+    } break;
+    case 16: {
+        _mm_storeu_si128((__m128i*)out, _mm_packs_epi32(a, b));
+    } break;
+    case 24: {
+        storeInt24x4(out, a);
+        storeInt24x4(out + 12, b);
+    } break;
+    case 32: {
+        _mm_storeu_si128((__m128i*)out, a);
+        _mm_storeu_si128((__m128i*)out + 1, b);
+    } break;
+    }
+}
+
+__attribute__((target("avx2")))
+void quantizeAvx2(const double *src, void *dst, size_t len, size_t stride,
+    const QuantizeSpec *q)
+{
+    size_t i = 0;
+    const size_t step = stride * (q->bits / 8);
+    if (q->format == FMT_FLOAT_PCM) {
+        const __m256d scale = _mm256_set1_pd(q->scale);
+        for (; i + 8 <= len; i += 8) {
+            __m128 lo = _mm256_cvtpd_ps(
+                _mm256_mul_pd(_mm256_loadu_pd(src + i), scale));
+            __m128 hi = _mm256_cvtpd_ps(
+                _mm256_mul_pd(_mm256_loadu_pd(src + i + 4), scale));
+            if (stride == 1) {
+                _mm_storeu_ps((float*)dst + i, lo);
+                _mm_storeu_ps((float*)dst + i + 4, hi);
+            } else {
+                float lanes[8];
+                _mm_storeu_ps(lanes, lo);
+                _mm_storeu_ps(lanes + 4, hi);
+                storeStridedFloat((uint8_t*)dst + i * step, lanes, 8, step);
+            }
+        }
+
+        quantizeScalar(src + i, (uint8_t*)dst + i * step, len - i, stride, q);
+        return;
+    }
+
+    const __m256d scale = _mm256_set1_pd(q->scale);
+    const __m256d offset = _mm256_set1_pd(q->offset);
+    const __m256d lo = _mm256_set1_pd(q->lo), hi = _mm256_set1_pd(q->hi);
+    for (; i + 8 <= len; i += 8) {
+        __m256d a = _mm256_add_pd(
+            _mm256_mul_pd(_mm256_loadu_pd(src + i), scale), offset);
+        __m256d b = _mm256_add_pd(
+            _mm256_mul_pd(_mm256_loadu_pd(src + i + 4), scale), offset);
+        a = _mm256_min_pd(_mm256_max_pd(a, lo), hi);
+        b = _mm256_min_pd(_mm256_max_pd(b, lo), hi);
+        storePcm8((uint8_t*)dst + i * step,
+            _mm256_cvtpd_epi32(a), _mm256_cvtpd_epi32(b), step, q->bits);
+    }
+
+    quantizeScalar(src + i, (uint8_t*)dst + i * step, len - i, stride, q);
+}
+
+__attribute__((target("avx2")))
+void quantizeFloatAvx2(const float *src, void *dst, size_t len,
+    size_t stride, const QuantizeSpec *q)
+{
+    size_t i = 0;
+    const size_t step = stride * (q->bits / 8);
+    const __m256 scale = _mm256_set1_ps((float)q->scale);
+    if (q->format == FMT_FLOAT_PCM) {
+        for (; i + 8 <= len; i += 8) {
+            __m256 v = _mm256_mul_ps(_mm256_loadu_ps(src + i), scale);
+            if (stride == 1) {
+                _mm256_storeu_ps((float*)dst + i, v);
+            } else {
+                float lanes[8];
+                _mm256_storeu_ps(lanes, v);
+                storeStridedFloat((uint8_t*)dst + i * step, lanes, 8, step);
+            }
+        }
+
+        quantizeFloatScalar(src + i, (uint8_t*)dst + i * step, len - i,
+            stride, q);
+        return;
+    }
+
+    const __m256 offset = _mm256_set1_ps((float)q->offset);
+    const __m256 lo = _mm256_set1_ps((float)q->lo);
+    const __m256 hi = _mm256_set1_ps((float)q->hi);
+    for (; i + 8 <= len; i += 8) {
+        __m256 a = _mm256_add_ps(
+            _mm256_mul_ps(_mm256_loadu_ps(src + i), scale), offset);
+        a = _mm256_min_ps(_mm256_max_ps(a, lo), hi);
+        __m256i v = _mm256_cvtps_epi32(a);
+        storePcm8((uint8_t*)dst + i * step, _mm256_castsi256_si128(v),
+            _mm256_extracti128_si256(v, 1), step, q->bits);
+    }
+
+    quantizeFloatScalar(src + i, (uint8_t*)dst + i * step, len - i, stride,
+        q);
+}
+
+__attribute__((target("avx512f,avx2")))
+void quantizeAvx512(const double *src, void *dst, size_t len, size_t stride,
+    const QuantizeSpec *q)
+{
+    size_t i = 0;
+    const size_t step = stride * (q->bits / 8);
+    if (q->format == FMT_FLOAT_PCM) {
+        const __m512d scale = _mm512_set1_pd(q->scale);
+        for (; i + 8 <= len; i += 8) {
+            __m256 v = _mm512_cvtpd_ps(
+                _mm512_mul_pd(_mm512_loadu_pd(src + i), scale));
+            if (stride == 1) {
+                _mm256_storeu_ps((float*)dst + i, v);
+            } else {
+                float lanes[8];
+                _mm256_storeu_ps(lanes, v);
+                storeStridedFloat((uint8_t*)dst + i * step, lanes, 8, step);
+            }
+        }
+
+        quantizeScalar(src + i, (uint8_t*)dst + i * step, len - i, stride, q);
+        return;
+    }
+
+    const __m512d scale = _mm512_set1_pd(q->scale);
+    const __m512d offset = _mm512_set1_pd(q->offset);
+    const __m512d lo = _mm512_set1_pd(q->lo), hi = _mm512_set1_pd(q->hi);
+    for (; i + 8 <= len; i += 8) {
+        __m512d a = _mm512_add_pd(
+            _mm512_mul_pd(_mm512_loadu_pd(src + i), scale), offset);
+        a = _mm512_min_pd(_mm512_max_pd(a, lo), hi);
+        __m256i v = _mm512_cvtpd_epi32(a);
+        storePcm8((uint8_t*)dst + i * step, _mm256_castsi256_si128(v),
+            _mm256_extracti128_si256(v, 1), step, q->bits);
+    }
+
+    quantizeScalar(src + i, (uint8_t*)dst + i * step, len - i, stride, q);
+}
+
+__attribute__((target("avx512f,avx2")))
+void quantizeFloatAvx512(const float *src, void *dst, size_t len,
+    size_t stride, const QuantizeSpec *q)
+{
+    size_t i = 0;
+    const size_t step = stride * (q->bits / 8);
+    const __m512 scale = _mm512_set1_ps((float)q->scale);
+    if (q->format == FMT_FLOAT_PCM) {
+        for (; i + 16 <= len; i += 16) {
+            __m512 v = _mm512_mul_ps(_mm512_loadu_ps(src + i), scale);
+            if (stride == 1) {
+                _mm512_storeu_ps((float*)dst + i, v);
+            } else {
+                float lanes[16];
+                _mm512_storeu_ps(lanes, v);
+                storeStridedFloat((uint8_t*)dst + i * step, lanes, 16, step);
+            }
+        }
+
+        quantizeFloatScalar(src + i, (uint8_t*)dst + i * step, len - i,
+            stride, q);
+        return;
+    }
+
+    const __m512 offset = _mm512_set1_ps((float)q->offset);
+    const __m512 lo = _mm512_set1_ps((float)q->lo);
+    const __m512 hi = _mm512_set1_ps((float)q->hi);
+    for (; i + 16 <= len; i += 16) {
+        __m512 a = _mm512_add_ps(
+            _mm512_mul_ps(_mm512_loadu_ps(src + i), scale), offset);
+        a = _mm512_min_ps(_mm512_max_ps(a, lo), hi);
+        __m512i v = _mm512_cvtps_epi32(a);
+        __m256i l = _mm512_castsi512_si256(v);
+        __m256i h = _mm512_extracti64x4_epi64(v, 1);
+        uint8_t *out = (uint8_t*)dst + i * step;
+        storePcm8(out, _mm256_castsi256_si128(l),
+            _mm256_extracti128_si256(l, 1), step, q->bits);
+        storePcm8(out + 8 * step, _mm256_castsi256_si128(h),
+            _mm256_extracti128_si256(h, 1), step, q->bits);
+    }
+
+    quantizeFloatScalar(src + i, (uint8_t*)dst + i * step, len - i, stride,
+        q);
+}
+#endif
+
+#if defined SIMD_NEON
+/* stores 4 (already saturated) int32 samples in the output's PCM format,
+   'step' bytes apart */
+static inline void storePcm4Neon(uint8_t *out, int32x4_t v, size_t step,
+    size_t bits)
+{
+    if (step != bits / 8) {
+        int32_t lanes[4];
+        vst1q_s32(lanes, v);
+        storeStrided(out, lanes, 4, step, bits);
+        return;
+    }
+
+    switch (bits) {
+    case 8: {
+        int16x4_t w = vqmovn_s32(v);
+        uint8x8_t u = vqmovun_s16(vcombine_s16(w, w));
+        vst1_lane_u32((uint32_t*)(void*)out, vreinterpret_u32_u8(u), 0);
+    } break;
+    case 16: {
+        vst1_s16((int16_t*)(void*)out, vqmovn_s32(v));
+    } break;
+    case 24: {
+        int32_t lanes[4];
+        vst1q_s32(lanes, v);
+        for (size_t j = 0; j < 4; j++) storeInt24(out + j * 3, lanes[j]);
+    } break;
+    case 32: {
+        vst1q_s32((int32_t*)(void*)out, v);
+    } break;
+    }
+}
+
+void quantizeNeon(const double *src, void *dst, size_t len, size_t stride,
+    const QuantizeSpec *q)
+{
+    size_t i = 0;
+    const size_t step = stride * (q->bits / 8);
+    if (q->format == FMT_FLOAT_PCM) {
+        const float64x2_t scale = vdupq_n_f64(q->scale);
+        for (; i + 4 <= len; i += 4) {
+            float32x2_t lo = vcvt_f32_f64(vmulq_f64(vld1q_f64(src + i), scale));
+            float32x2_t hi = vcvt_f32_f64(
+                vmulq_f64(vld1q_f64(src + i + 2), scale));
+            if (stride == 1) {
+                vst1q_f32((float*)dst + i, vcombine_f32(lo, hi));
+            } else {
+                float lanes[4];
+                vst1q_f32(lanes, vcombine_f32(lo, hi));
+                storeStridedFloat((uint8_t*)dst + i * step, lanes, 4, step);
+            }
+        }
+
+        quantizeScalar(src + i, (uint8_t*)dst + i * step, len - i, stride, q);
+        return;
+    }
+
+    const float64x2_t scale = vdupq_n_f64(q->scale);
+    const float64x2_t offset = vdupq_n_f64(q->offset);
+    const float64x2_t lo = vdupq_n_f64(q->lo), hi = vdupq_n_f64(q->hi);
+    for (; i + 4 <= len; i += 4) {
+        float64x2_t a = vaddq_f64(vmulq_f64(vld1q_f64(src + i), scale), offset);
+        float64x2_t b = vaddq_f64(
+            vmulq_f64(vld1q_f64(src + i + 2), scale), offset);
+        a = vminq_f64(vmaxq_f64(a, lo), hi);
+        b = vminq_f64(vmaxq_f64(b, lo), hi);
+        int32x4_t v = vcombine_s32(vmovn_s64(vcvtnq_s64_f64(a)),
+            vmovn_s64(vcvtnq_s64_f64(b)));
+        storePcm4Neon((uint8_t*)dst + i * step, v, step, q->bits);
+    }
+
+    quantizeScalar(src + i, (uint8_t*)dst + i * step, len - i, stride, q);
+}
+
+void quantizeFloatNeon(const float *src, void *dst, size_t len,
+    size_t stride, const QuantizeSpec *q)
+{
+    size_t i = 0;
+    const size_t step = stride * (q->bits / 8);
+    const float32x4_t scale = vdupq_n_f32((float)q->scale);
+    if (q->format == FMT_FLOAT_PCM) {
+        for (; i + 4 <= len; i += 4) {
+            float32x4_t v = vmulq_f32(vld1q_f32(src + i), scale);
+            if (stride == 1) {
+                vst1q_f32((float*)dst + i, v);
+            } else {
+                float lanes[4];
+                vst1q_f32(lanes, v);
+                storeStridedFloat((uint8_t*)dst + i * step, lanes, 4, step);
+            }
+        }
+
+        quantizeFloatScalar(src + i, (uint8_t*)dst + i * step, len - i,
+            stride, q);
+        return;
+    }
+
+    const float32x4_t offset = vdupq_n_f32((float)q->offset);
+    const float32x4_t lo = vdupq_n_f32((float)q->lo);
+    const float32x4_t hi = vdupq_n_f32((float)q->hi);
+    for (; i + 4 <= len; i += 4) {
+        float32x4_t a = vaddq_f32(vmulq_f32(vld1q_f32(src + i), scale), offset);
+        a = vminq_f32(vmaxq_f32(a, lo), hi);
+        storePcm4Neon((uint8_t*)dst + i * step, vcvtnq_s32_f32(a), step,
+            q->bits);
+    }
+
+    quantizeFloatScalar(src + i, (uint8_t*)dst + i * step, len - i, stride,
+        q);
+}
+#endif
+
+/* dither comes from a counter-based generator: the 64-bit value for sample 'i'
+   is the splitmix64 finalizer applied to 'key + (i + 1) * DITHER_GAMMA', so it
+   depends only on the seed and the sample's index. Its two 32-bit halves are
+   the uniform variables whose difference forms the TPDF value */
+#define DITHER_GAMMA 0x9E3779B97F4A7C15ull
+#define DITHER_MUL_1 0xBF58476D1CE4E5B9ull
+#define DITHER_MUL_2 0x94D049BB133111EBull
+
+/* kernels scale the samples by 'gain' before adding the dither, which
+   normalizes them in the same pass */
+typedef void (*DitherKernel)(double *buf, size_t len, uint64_t counter,
+    double gain, double scale);
+
+typedef void (*DitherFloatKernel)(float *buf, size_t len, uint64_t counter,
+    float gain, float scale);
+
+void ditherScalar(double *buf, size_t len, uint64_t counter, double gain,
+    double scale);
+void ditherFloatScalar(float *buf, size_t len, uint64_t counter, float gain,
+    float scale);
+
+static DitherKernel ditherKernel = ditherScalar;
+static DitherFloatKernel ditherFloatKernel = ditherFloatScalar;
+
+static inline uint64_t splitmix64(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * DITHER_MUL_1;
+    x = (x ^ (x >> 27)) * DITHER_MUL_2;
+    return x ^ (x >> 31);
+}
+
+typedef struct DitherJob {
+    void *buf;
+    SamplePrecision precision;
+    size_t start;
+    uint64_t key;
+    double gain, scale;
+} DitherJob;
+
+void ditherTile(void *ctx, size_t tile, size_t start, size_t len)
+{
+    (void)tile;
+    const DitherJob *job = ctx;
+    uint64_t counter = job->key + (job->start + start + 1) * DITHER_GAMMA;
+    if (job->precision == PRECISION_FLOAT) {
+        ditherFloatKernel((float*)job->buf + start, len, counter,
+            (float)job->gain, (float)job->scale);
+    } else {
+        ditherKernel((double*)job->buf + start, len, counter, job->gain,
+            job->scale);
+    }
+}
+
+/* scales samples [start, start+len) of a channel by 'gain' and adds +/-1 LSB
+   of TPDF dither to them (each channel gets its own key, so their dither is
+   uncorrelated) */
+void applyDither(const Parameters *p, size_t channel, void *buf,
+    size_t start, size_t len, double gain)
+{
+    double begin = spanBegin();
+    DitherJob job = {
+        .buf = buf,
+        .precision = samplePrecision(p),
+        .start = start,
+        .key = splitmix64(p->ditherSeed + channel * DITHER_GAMMA),
+        .gain = gain,
+        /* the difference of two int32 spans (-2^32, 2^32) */
+        .scale = 1.0 / pow(2.0, p->bitsPerSample - 1.0) / 4294967296.0,
+    };
+
+    parallelFor(len, ditherTile, &job);
+    spanEnd(SPAN_DITHER, begin);
+}
+
+void ditherScalar(double *buf, size_t len, uint64_t counter, double gain,
+    double scale)
+{
+    for (size_t i = 0; i < len; i++, counter += DITHER_GAMMA) {
+        uint64_t r = splitmix64(counter);
+        double d = ((double)(int32_t)(r >> 32) - (double)(int32_t)r) * scale;
+        buf[i] = buf[i] * gain + d;
+    }
+}
+
+void ditherFloatScalar(float *buf, size_t len, uint64_t counter, float gain,
+    float scale)
+{
+    for (size_t i = 0; i < len; i++, counter += DITHER_GAMMA) {
+        uint64_t r = splitmix64(counter);
+        float d = ((float)(int32_t)(r >> 32) - (float)(int32_t)r) * scale;
+        buf[i] = buf[i] * gain + d;
+    }
+}
+
+#if defined SIMD_X86
+/* 64-bit lane multiplication built from 32-bit ones (AVX2 has no vpmullq) */
+__attribute__((target("avx2")))
+static inline __m256i mullo64Avx2(__m256i a, __m256i b)
+{
+    __m256i lo = _mm256_mul_epu32(a, b);
+    __m256i cross = _mm256_add_epi64(
+        _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+        _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i splitmix64Avx2(__m256i x)
+{
+    const __m256i mul1 = _mm256_set1_epi64x((int64_t)DITHER_MUL_1);
+    const __m256i mul2 = _mm256_set1_epi64x((int64_t)DITHER_MUL_2);
+    __m256i r = _mm256_xor_si256(x, _mm256_srli_epi64(x, 30));
+    r = mullo64Avx2(r, mul1);
+    r = mullo64Avx2(_mm256_xor_si256(r, _mm256_srli_epi64(r, 27)), mul2);
+    return _mm256_xor_si256(r, _mm256_srli_epi64(r, 31));
+}
+
+__attribute__((target("avx2")))
+void ditherAvx2(double *buf, size_t len, uint64_t counter, double gain,
+    double scale)
+{
+    const __m256i gamma = _mm256_set1_epi64x((int64_t)(4 * DITHER_GAMMA));
+    const __m256i halves = _mm256_setr_epi32(1, 3, 5, 7, 0, 2, 4, 6);
+    const __m256d g = _mm256_set1_pd(gain), s = _mm256_set1_pd(scale);
+    __m256i x = _mm256_setr_epi64x((int64_t)counter,
+        (int64_t)(counter + DITHER_GAMMA), (int64_t)(counter + 2 * DITHER_GAMMA),
+        (int64_t)(counter + 3 * DITHER_GAMMA));
+
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4) {
+        /* high halves end up in the low 128 bits, low halves in the high */
+        __m256i r = _mm256_permutevar8x32_epi32(splitmix64Avx2(x), halves);
+        __m256d hi = _mm256_cvtepi32_pd(_mm256_castsi256_si128(r));
+        __m256d lo = _mm256_cvtepi32_pd(_mm256_extracti128_si256(r, 1));
+        __m256d d = _mm256_mul_pd(_mm256_sub_pd(hi, lo), s);
+        _mm256_storeu_pd(buf + i,
+            _mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(buf + i), g), d));
+        x = _mm256_add_epi64(x, gamma);
+    }
+
+    ditherScalar(buf + i, len - i, counter + i * DITHER_GAMMA, gain, scale);
+}
+
+__attribute__((target("avx2")))
+void ditherFloatAvx2(float *buf, size_t len, uint64_t counter, float gain,
+    float scale)
+{
+    const __m256i gamma = _mm256_set1_epi64x((int64_t)(8 * DITHER_GAMMA));
+    const __m256i halves = _mm256_setr_epi32(1, 3, 5, 7, 0, 2, 4, 6);
+    const __m256 g = _mm256_set1_ps(gain), s = _mm256_set1_ps(scale);
+    __m256i x0 = _mm256_setr_epi64x((int64_t)counter,
+        (int64_t)(counter + DITHER_GAMMA), (int64_t)(counter + 2 * DITHER_GAMMA),
+        (int64_t)(counter + 3 * DITHER_GAMMA));
+    __m256i x1 = _mm256_add_epi64(x0,
+        _mm256_set1_epi64x((int64_t)(4 * DITHER_GAMMA)));
+
+    /* two sets of 4 counters fill the 8 float lanes */
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        __m256i r0 = _mm256_permutevar8x32_epi32(splitmix64Avx2(x0), halves);
+        __m256i r1 = _mm256_permutevar8x32_epi32(splitmix64Avx2(x1), halves);
+        __m256 hi = _mm256_cvtepi32_ps(_mm256_permute2x128_si256(r0, r1, 0x20));
+        __m256 lo = _mm256_cvtepi32_ps(_mm256_permute2x128_si256(r0, r1, 0x31));
+        __m256 d = _mm256_mul_ps(_mm256_sub_ps(hi, lo), s);
+        _mm256_storeu_ps(buf + i,
+            _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(buf + i), g), d));
+        x0 = _mm256_add_epi64(x0, gamma);
+        x1 = _mm256_add_epi64(x1, gamma);
+    }
+
+    ditherFloatScalar(buf + i, len - i, counter + i * DITHER_GAMMA, gain,
+        scale);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i mullo64Avx512(__m512i a, __m512i b)
+{
+    __m512i lo = _mm512_mul_epu32(a, b);
+    __m512i cross = _mm512_add_epi64(
+        _mm512_mul_epu32(_mm512_srli_epi64(a, 32), b),
+        _mm512_mul_epu32(a, _mm512_srli_epi64(b, 32)));
+    return _mm512_add_epi64(lo, _mm512_slli_epi64(cross, 32));
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i splitmix64Avx512(__m512i x)
+{
+    const __m512i mul1 = _mm512_set1_epi64((int64_t)DITHER_MUL_1);
+    const __m512i mul2 = _mm512_set1_epi64((int64_t)DITHER_MUL_2);
+    __m512i r = _mm512_xor_si512(x, _mm512_srli_epi64(x, 30));
+    r = mullo64Avx512(r, mul1);
+    r = mullo64Avx512(_mm512_xor_si512(r, _mm512_srli_epi64(r, 27)), mul2);
+    return _mm512_xor_si512(r, _mm512_srli_epi64(r, 31));
+}
+
+__attribute__((target("avx512f")))
+void ditherAvx512(double *buf, size_t len, uint64_t counter, double gain,
+    double scale)
+{
+    const __m512i gamma = _mm512_set1_epi64((int64_t)(8 * DITHER_GAMMA));
+    const __m512i halves = _mm512_setr_epi32(
+        1, 3, 5, 7, 9, 11, 13, 15, 0, 2, 4, 6, 8, 10, 12, 14);
+    const __m512d g = _mm512_set1_pd(gain), s = _mm512_set1_pd(scale);
+    __m512i x = _mm512_add_epi64(_mm512_set1_epi64((int64_t)counter),
+        _mm512_setr_epi64(0, (int64_t)DITHER_GAMMA,
+        (int64_t)(2 * DITHER_GAMMA), (int64_t)(3 * DITHER_GAMMA),
+        (int64_t)(4 * DITHER_GAMMA), (int64_t)(5 * DITHER_GAMMA),
+        (int64_t)(6 * DITHER_GAMMA), (int64_t)(7 * DITHER_GAMMA)));
+
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        __m512i r = _mm512_permutexvar_epi32(halves, splitmix64Avx512(x));
+        __m512d hi = _mm512_cvtepi32_pd(_mm512_castsi512_si256(r));
+        __m512d lo = _mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(r, 1));
+        __m512d d = _mm512_mul_pd(_mm512_sub_pd(hi, lo), s);
+        _mm512_storeu_pd(buf + i,
+            _mm512_add_pd(_mm512_mul_pd(_mm512_loadu_pd(buf + i), g), d));
+        x = _mm512_add_epi64(x, gamma);
+    }
+
+    ditherScalar(buf + i, len - i, counter + i * DITHER_GAMMA, gain, scale);
+}
+
+__attribute__((target("avx512f")))
+void ditherFloatAvx512(float *buf, size_t len, uint64_t counter, float gain,
+    float scale)
+{
+    const __m512i gamma = _mm512_set1_epi64((int64_t)(16 * DITHER_GAMMA));
+    /* the high (odd) and low (even) halves of both sets of counters */
+    const __m512i odd = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15,
+        17, 19, 21, 23, 25, 27, 29, 31);
+    const __m512i even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14,
+        16, 18, 20, 22, 24, 26, 28, 30);
+    const __m512 g = _mm512_set1_ps(gain), s = _mm512_set1_ps(scale);
+    __m512i x0 = _mm512_add_epi64(_mm512_set1_epi64((int64_t)counter),
+        _mm512_setr_epi64(0, (int64_t)DITHER_GAMMA,
+        (int64_t)(2 * DITHER_GAMMA), (int64_t)(3 * DITHER_GAMMA),
+        (int64_t)(4 * DITHER_GAMMA), (int64_t)(5 * DITHER_GAMMA),
+        (int64_t)(6 * DITHER_GAMMA), (int64_t)(7 * DITHER_GAMMA)));
+    __m512i x1 = _mm512_add_epi64(x0,
+        _mm512_set1_epi64((int64_t)(8 * DITHER_GAMMA)));
+
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m512i r0 = splitmix64Avx512(x0), r1 = splitmix64Avx512(x1);
+        __m512 hi = _mm512_cvtepi32_ps(_mm512_permutex2var_epi32(r0, odd, r1));
+        __m512 lo = _mm512_cvtepi32_ps(
+            _mm512_permutex2var_epi32(r0, even, r1));
+        __m512 d = _mm512_mul_ps(_mm512_sub_ps(hi, lo), s);
+        _mm512_storeu_ps(buf + i,
+            _mm512_add_ps(_mm512_mul_ps(_mm512_loadu_ps(buf + i), g), d));
+        x0 = _mm512_add_epi64(x0, gamma);
+        x1 = _mm512_add_epi64(x1, gamma);
+    }
+
+    ditherFloatScalar(buf + i, len - i, counter + i * DITHER_GAMMA, gain,
+        scale);
+}
+#endif
+
+/* noise comes from the same generator as the dither (keyed per channel and
+   per source), one uniform 32-bit value per sample, which makes every sample
+   of white and pink noise depend only on its index */
+#define NOISE_PINK_ROWS 16 // Voss-McCartney rows, down to 'rate / 2^17' Hz
+#define NOISE_BROWN_CORNER 20.0 // Hz, below which brown noise flattens out
+/* filtered (brown and band-limited) noise restarts its filters from silence
+   a warm-up ahead of every segment, long enough for the silence to decay to
+   NOISE_SETTLE of the signal (up to NOISE_WARMUP_MAX), so that its samples
+   don't depend on how the wave is split up either. Segments are a divisor of
+   STREAM_BLOCK_LEN, which keeps streamed blocks from splitting one */
+#define NOISE_SEGMENT_LEN (16 * KB)
+#define NOISE_SETTLE 1e-9
+#define NOISE_WARMUP_MAX (4 * NOISE_SEGMENT_LEN)
+
+/* kernels add 'amp' times the signed 32-bit value drawn for each sample */
+typedef void (*NoiseKernel)(double *buf, size_t len, uint64_t counter,
+    double amp);
+
+void noiseScalar(double *buf, size_t len, uint64_t counter, double amp);
+
+static NoiseKernel noiseKernel = noiseScalar;
+
+void noiseScalar(double *buf, size_t len, uint64_t counter, double amp)
+{
+    for (size_t i = 0; i < len; i++, counter += DITHER_GAMMA) {
+        buf[i] += (double)(int32_t)(splitmix64(counter) >> 32) * amp;
+    }
+}
+
+#if defined SIMD_X86
+__attribute__((target("avx2")))
+void noiseAvx2(double *buf, size_t len, uint64_t counter, double amp)
+{
+    const __m256i gamma = _mm256_set1_epi64x((int64_t)(4 * DITHER_GAMMA));
+    const __m256i halves = _mm256_setr_epi32(1, 3, 5, 7, 0, 2, 4, 6);
+    const __m256d a = _mm256_set1_pd(amp);
+    __m256i x = _mm256_setr_epi64x((int64_t)counter,
+        (int64_t)(counter + DITHER_GAMMA), (int64_t)(counter + 2 * DITHER_GAMMA),
+        (int64_t)(counter + 3 * DITHER_GAMMA));
+
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4) {
+        __m256i r = _mm256_permutevar8x32_epi32(splitmix64Avx2(x), halves);
+        __m256d u = _mm256_cvtepi32_pd(_mm256_castsi256_si128(r));
+        _mm256_storeu_pd(buf + i,
+            _mm256_add_pd(_mm256_loadu_pd(buf + i), _mm256_mul_pd(u, a)));
+        x = _mm256_add_epi64(x, gamma);
+    }
+
+    noiseScalar(buf + i, len - i, counter + i * DITHER_GAMMA, amp);
+}
+
+__attribute__((target("avx512f")))
+void noiseAvx512(double *buf, size_t len, uint64_t counter, double amp)
+{
+    const __m512i gamma = _mm512_set1_epi64((int64_t)(8 * DITHER_GAMMA));
+    const __m512i halves = _mm512_setr_epi32(
+        1, 3, 5, 7, 9, 11, 13, 15, 0, 2, 4, 6, 8, 10, 12, 14);
+    const __m512d a = _mm512_set1_pd(amp);
+    __m512i x = _mm512_add_epi64(_mm512_set1_epi64((int64_t)counter),
+        _mm512_setr_epi64(0, (int64_t)DITHER_GAMMA,
+        (int64_t)(2 * DITHER_GAMMA), (int64_t)(3 * DITHER_GAMMA),
+        (int64_t)(4 * DITHER_GAMMA), (int64_t)(5 * DITHER_GAMMA),
+        (int64_t)(6 * DITHER_GAMMA), (int64_t)(7 * DITHER_GAMMA)));
+
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        __m512i r = _mm512_permutexvar_epi32(halves, splitmix64Avx512(x));
+        __m512d u = _mm512_cvtepi32_pd(_mm512_castsi512_si256(r));
+        _mm512_storeu_pd(buf + i,
+            _mm512_add_pd(_mm512_loadu_pd(buf + i), _mm512_mul_pd(u, a)));
+        x = _mm512_add_epi64(x, gamma);
+    }
+
+    noiseScalar(buf + i, len - i, counter + i * DITHER_GAMMA, amp);
+}
+#endif
+
+/* besides its coefficients, a biquad keeps what it takes to run it four
+   samples at a time (see biquadPrepare) */
+typedef struct Biquad {
+    double b0, b1, b2, a1, a2;
+    double h[4][4]; // input j's share of output l
+    double p[4][2]; // the state's share of output l
+    double a4[2][2]; // the state's share of the state four samples on
+    double q[2][4]; // input j's share of the state four samples on
+} Biquad;
+
+/* with the state 's' of the transposed direct form II, a sample 'x' gives
+   'y = b0 x + s1' and moves the state on by 's <- A s + B x', which unrolls
+   into the outputs and state of four samples as functions of the state
+   before them: the dependency chain from block to block is then a quarter as
+   long, and the outputs within a block are four independent lanes */
+void biquadPrepare(Biquad *f)
+{
+    const double a[2][2] = {{ -f->a1, 1.0 }, { -f->a2, 0.0 }};
+    const double b[2] = { f->b1 - f->a1 * f->b0, f->b2 - f->a2 * f->b0 };
+    double pow[2][2] = {{ 1.0, 0.0 }, { 0.0, 1.0 }}; // a^l
+    double impulse[4] = { f->b0 }; // output l of a unit input at 0
+
+    for (size_t l = 0; l < 4; l++) {
+        f->p[l][0] = pow[0][0], f->p[l][1] = pow[0][1];
+        if (l > 0) {
+            impulse[l] = f->p[l - 1][0] * b[0] + f->p[l - 1][1] * b[1];
+        }
+
+        /* input 3 - l reaches the state four samples on through a^l */
+        f->q[0][3 - l] = pow[0][0] * b[0] + pow[0][1] * b[1];
+        f->q[1][3 - l] = pow[1][0] * b[0] + pow[1][1] * b[1];
+
+        double next[2][2];
+        for (size_t i = 0; i < 2; i++) {
+            for (size_t j = 0; j < 2; j++) {
+                next[i][j] = pow[i][0] * a[0][j] + pow[i][1] * a[1][j];
+            }
+        }
+
+        memcpy(pow, next, sizeof(pow));
+    }
+
+    memcpy(f->a4, pow, sizeof(pow));
+    for (size_t l = 0; l < 4; l++) {
+        for (size_t j = 0; j < 4; j++) {
+            f->h[l][j] = j <= l ? impulse[l - j] : 0.0;
+        }
+    }
+}
+
+/* RBJ cookbook butterworth (Q = 1/sqrt(2)) low-pass or high-pass at 'freq' */
+Biquad biquadButterworth(double freq, uint32_t rate, bool highPass)
+{
+    double w = 2.0 * PI * freq / rate;
+    double c = cos(w), alpha = sin(w) / sqrt(2.0), a0 = 1.0 + alpha;
+    double b1 = highPass ? -(1.0 + c) : 1.0 - c;
+    return (Biquad){
+        .b0 = fabs(b1) / 2.0 / a0,
+        .b1 = b1 / a0,
+        .b2 = fabs(b1) / 2.0 / a0,
+        .a1 = -2.0 * c / a0,
+        .a2 = (1.0 - alpha) / a0,
+    };
+}
+
+/* the radius of its slowest-decaying pole */
+double biquadPoleRadius(const Biquad *f)
+{
+    double disc = f->a1 * f->a1 - 4.0 * f->a2;
+    if (disc < 0.0) return sqrt(f->a2);
+
+    double r0 = fabs(-f->a1 + sqrt(disc)) / 2.0;
+    double r1 = fabs(-f->a1 - sqrt(disc)) / 2.0;
+    return r0 > r1 ? r0 : r1;
+}
+
+/* filters 'buf' in place, four samples at a time and the rest one by one
+   (transposed direct form II), with its two state variables in 's' */
+void biquadRun(const Biquad *f, double *s, double *buf, size_t len)
+{
+    double s1 = s[0], s2 = s[1];
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4) {
+        const double *x = buf + i;
+        double y[4], u[2];
+        for (size_t l = 0; l < 4; l++) {
+            y[l] = f->p[l][0] * s1 + f->p[l][1] * s2 + f->h[l][0] * x[0] +
+                f->h[l][1] * x[1] + f->h[l][2] * x[2] + f->h[l][3] * x[3];
+        }
+
+        for (size_t k = 0; k < 2; k++) {
+            u[k] = f->q[k][0] * x[0] + f->q[k][1] * x[1] +
+                f->q[k][2] * x[2] + f->q[k][3] * x[3];
+        }
+
+        double t = f->a4[0][0] * s1 + f->a4[0][1] * s2 + u[0];
+        s2 = f->a4[1][0] * s1 + f->a4[1][1] * s2 + u[1];
+        s1 = t;
+        memcpy(buf + i, y, sizeof(y));
+    }
+
+    for (; i < len; i++) {
+        double x = buf[i], y = f->b0 * x + s1;
+        s1 = f->b1 * x - f->a1 * y + s2;
+        s2 = f->b2 * x - f->a2 * y;
+        buf[i] = y;
+    }
+
+    s[0] = s1, s[1] = s2;
+}
+
+#define NOISE_MAX_STAGES 2
+
+typedef struct NoiseJob {
+    const Parameters *p;
+    WaveType type;
+    void *buf;
+    size_t start, len;
+    SamplePrecision precision;
+    uint64_t key;
+    uint64_t rowKeys[NOISE_PINK_ROWS];
+    Biquad stages[NOISE_MAX_STAGES];
+    size_t stageCount;
+    size_t warmup;
+} NoiseJob;
+
+/* Voss-McCartney: row k holds a value for 2^(k+1) samples, changing where
+   sample indices have exactly k trailing zeros (so no two rows change at
+   once), and the rows plus a white one add up to pink noise. The value row k
+   holds at sample n is simply the (n + 2^k) >> (k + 1)-th one it draws, and
+   all rows from k up stay put over each 2^k samples (the m-th run of which
+   gets row k's (m + 1) >> 1-th value), so the sums are built top down in
+   place: a run's sum is its parent's plus a value of its own */
+void noisePink(const NoiseJob *job, double *buf, size_t start, size_t len)
+{
+    const double amp = 1.0 / 2147483648.0;
+    double row[RENDER_SCRATCH_LEN / 2 + 2];
+    size_t end = start + len - 1;
+    for (size_t k = NOISE_PINK_ROWS; k-- > 0;) {
+        size_t base = start >> k, count = (end >> k) - base + 1;
+        size_t first = (base + 1) >> 1, last = ((end >> k) + 1) >> 1;
+        memset(row, 0, (last - first + 1) * sizeof(*row));
+        noiseKernel(row, last - first + 1,
+            job->rowKeys[k] + (first + 1) * DITHER_GAMMA, amp);
+
+        /* backwards, as a run's parent never sits past it */
+        for (size_t m = base + count; m-- > base;) {
+            double parent = k + 1 < NOISE_PINK_ROWS ?
+                buf[(m >> 1) - (base >> 1)] : 0.0;
+            buf[m - base] = parent + row[((m + 1) >> 1) - first];
+        }
+    }
+
+    noiseKernel(buf, len, job->key + (start + 1) * DITHER_GAMMA, amp);
+}
+
+/* adds samples [start, start+len) of the job's noise to 'buf' (running its
+   filters from and into 'state') */
+void noiseBlock(const NoiseJob *job, double *buf, size_t start, size_t len,
+    double state[NOISE_MAX_STAGES][2])
+{
+    const double amp = 1.0 / 2147483648.0;
+    memset(buf, 0, len * sizeof(*buf));
+    if (job->type == WAVE_PINK_NOISE) {
+        noisePink(job, buf, start, len);
+        return;
+    }
+
+    noiseKernel(buf, len, job->key + (start + 1) * DITHER_GAMMA, amp);
+    for (size_t i = 0; i < job->stageCount; i++) {
+        biquadRun(&job->stages[i], state[i], buf, len);
+    }
+}
+
+/* renders the part of [start, start+len) that falls in the 'tile'-th segment
+   it overlaps, one scratch block at a time */
+void noiseTile(void *ctx, size_t tile, size_t start, size_t len)
+{
+    (void)start, (void)len;
+    const NoiseJob *job = ctx;
+    size_t segment = (job->start / NOISE_SEGMENT_LEN + tile) *
+        NOISE_SEGMENT_LEN;
+    size_t from = segment > job->start ? segment : job->start;
+    size_t to = job->start + job->len;
+    if (to > segment + NOISE_SEGMENT_LEN) to = segment + NOISE_SEGMENT_LEN;
+
+    size_t n = from;
+    if (job->stageCount > 0) {
+        n = segment > job->warmup ? segment - job->warmup : 0;
+    }
+
+    double state[NOISE_MAX_STAGES][2] = {{0}};
+    double scratch[RENDER_SCRATCH_LEN];
+    while (n < to) {
+        size_t count = to - n < RENDER_SCRATCH_LEN ? to - n :
+            RENDER_SCRATCH_LEN;
+        if (n < from && n + count > from) count = from - n;
+
+        noiseBlock(job, scratch, n, count, state);
+        if (n >= from && job->precision == PRECISION_FLOAT) {
+            narrowSamples((float*)job->buf + (n - job->start), scratch, count);
+        } else if (n >= from) {
+            memcpy((double*)job->buf + (n - job->start), scratch,
+                count * sizeof(*scratch));
+        }
+
+        n += count;
+    }
+}
+
+/* sets up the filters that shape the 'type' noise, returning their count */
+size_t noiseFilters(const Parameters *p, WaveType type,
+    Biquad stages[NOISE_MAX_STAGES])
+{
+    size_t count = 0;
+    if (type == WAVE_BROWN_NOISE) {
+        /* a leaky integrator: -6dB per octave above the corner */
+        double a = exp(-2.0 * PI * NOISE_BROWN_CORNER / p->sampleRate);
+        stages[count++] = (Biquad){ .b0 = 1.0 - a, .a1 = -a };
+    } else if (type == WAVE_BAND_NOISE) {
+        stages[count++] = biquadButterworth(p->noiseBand[0], p->sampleRate,
+            true);
+        if (p->noiseBand[1] * 2.0 < p->sampleRate) {
+            stages[count++] = biquadButterworth(p->noiseBand[1],
+                p->sampleRate, false);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) biquadPrepare(&stages[i]);
+    return count;
+}
+
+/* upper bound on the magnitude of the 'type' noise's (unnormalized) samples:
+   white ones are a signed 32-bit value times 2^-31, so within 1, pink ones
+   add up the rows and a white value, and filtered ones can't exceed the sum
+   of the magnitudes of their filters' impulse response (taken over twice the
+   longest warm-up, past which what's left of it is negligible) */
+double noisePeakBound(const Parameters *p, WaveType type)
+{
+    if (type == WAVE_WHITE_NOISE) return 1.0;
+    if (type == WAVE_PINK_NOISE) return NOISE_PINK_ROWS + 1.0;
+
+    Biquad stages[NOISE_MAX_STAGES];
+    size_t count = noiseFilters(p, type, stages), len = 2 * NOISE_WARMUP_MAX;
+    double state[NOISE_MAX_STAGES][2] = {{0}};
+    double *h = calloc(len, sizeof(*h));
+    if (h == NULL) {
+        ERR_OUT_OF_MEMORY();
+        exit(EXIT_FAILURE);
+    }
+
+    h[0] = 1.0;
+    for (size_t i = 0; i < count; i++) {
+        biquadRun(&stages[i], state[i], h, len);
+    }
+
+    double sum = 0.0;
+    for (size_t i = 0; i < len; i++) sum += fabs(h[i]);
+
+    free(h);
+    return sum;
+}
+
+/* renders samples [start, start+len) of a channel's (unnormalized) noise in
+   the wave's sample precision, a segment per task */
+void noiseRender(const Parameters *p, const Channel *ch, void *buf,
+    size_t start, size_t len)
+{
+    NoiseJob job = {
+        .p = p,
+        .type = ch->waveType,
+        .buf = buf,
+        .start = start,
+        .len = len,
+        .precision = samplePrecision(p),
+        /* salted, so that it never matches the dither's key */
+        .key = splitmix64(splitmix64(p->noiseSeed) +
+            (ch->index + 1) * DITHER_GAMMA),
+    };
+
+    for (size_t k = 0; k < NOISE_PINK_ROWS; k++) {
+        job.rowKeys[k] = splitmix64(job.key + k + 1);
+    }
+
+    job.stageCount = noiseFilters(p, ch->waveType, job.stages);
+    for (size_t i = 0; i < job.stageCount; i++) {
+        double r = biquadPoleRadius(&job.stages[i]);
+        double warmup = r > 0.0 ? ceil(log(NOISE_SETTLE) / log(r)) : 0.0;
+        if (warmup > NOISE_WARMUP_MAX) warmup = NOISE_WARMUP_MAX;
+        if (warmup > job.warmup) job.warmup = (size_t)warmup;
+    }
+
+    /* blocks of four then always line up with the segments */
+    job.warmup = (job.warmup + 3) / 4 * 4;
+
+    double begin = spanBegin();
+    size_t first = start / NOISE_SEGMENT_LEN;
+    size_t last = len > 0 ? (start + len - 1) / NOISE_SEGMENT_LEN : first;
+    if (len > 0) parallelTasks(last - first + 1, noiseTile, &job);
+    spanEnd(SPAN_RENDER, begin);
+
+    counterAdd(COUNTER_SAMPLES, len);
+    counterAdd(COUNTER_PARTIALS, len);
+}
+
+/* picks the widest kernels the CPU supports (or the requested ones, as long
+   as they are supported) and returns the level in use */
+SimdLevel simdInit(SimdLevel requested)
+{
+    SimdLevel best = SIMD_SCALAR;
+#if defined SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) best = SIMD_SSE2;
+    if (__builtin_cpu_supports("avx2")) best = SIMD_AVX2;
+    if (__builtin_cpu_supports("avx512f") && best == SIMD_AVX2) {
+        best = SIMD_AVX512;
+    }
+#elif defined SIMD_NEON
+    best = SIMD_NEON;
+#endif
+
+    SimdLevel level = best;
+    if (requested != SIMD_AUTO) {
+        bool supported = requested == SIMD_SCALAR ||
+            (best == SIMD_NEON ? requested == SIMD_NEON :
+            requested != SIMD_NEON && requested <= best);
+        if (supported) {
+            level = requested;
+        } else {
+            loggerAppend(ERR_ARG, "%s kernels aren't supported by this CPU"
+                " (using %s)", simdLevelToString(requested),
+                simdLevelToString(best));
+        }
+    }
+
+    /* there are no SSE2 or NEON dither (or noise) kernels: neither has a
+       cheap way of multiplying 64-bit lanes, so the scalar loop is just as
+       fast there */
+    quantizeKernel = quantizeScalar;
+    quantizeFloatKernel = quantizeFloatScalar;
+    ditherKernel = ditherScalar;
+    ditherFloatKernel = ditherFloatScalar;
+    noiseKernel = noiseScalar;
+    peakKernel = peakScalar;
+    peakFloatKernel = peakFloatScalar;
+    switch (level) {
+#if defined SIMD_X86
+    case SIMD_SSE2: {
+        quantizeKernel = quantizeSse2;
+        quantizeFloatKernel = quantizeFloatSse2;
+        peakKernel = peakSse2;
+        peakFloatKernel = peakFloatSse2;
+    } break;
+    case SIMD_AVX2: {
+        quantizeKernel = quantizeAvx2;
+        quantizeFloatKernel = quantizeFloatAvx2;
+        ditherKernel = ditherAvx2;
+        ditherFloatKernel = ditherFloatAvx2;
+        noiseKernel = noiseAvx2;
+        peakKernel = peakAvx2;
+        peakFloatKernel = peakFloatAvx2;
+    } break;
+    case SIMD_AVX512: {
+        quantizeKernel = quantizeAvx512;
+        quantizeFloatKernel = quantizeFloatAvx512;
+        ditherKernel = ditherAvx512;
+        ditherFloatKernel = ditherFloatAvx512;
+        noiseKernel = noiseAvx512;
+        peakKernel = peakAvx512;
+        peakFloatKernel = peakFloatAvx512;
+    } break;
+#elif defined SIMD_NEON
+    case SIMD_NEON: {
+        quantizeKernel = quantizeNeon;
+        quantizeFloatKernel = quantizeFloatNeon;
+        peakKernel = peakNeon;
+        peakFloatKernel = peakFloatNeon;
+    } break;
+#endif
+    default: break;
+    }
+
+    simdLevel = level;
+    return level;
+}
+
+#define STREAM_BLOCK_LEN (16 * KB) // per thread
+
+/* streams the wave to 'f' one fixed-size block at a time (generate, dither,
+   quantize, write, with the normalization folded into the dither or the
+   quantization), so memory usage doesn't depend on its duration */
+void waveStreamWrite(const Parameters *p, Output *out)
+{
+    size_t total = waveSampleCount(p);
+    size_t bits = p->bitsPerSample;
+    size_t channels = p->channelCount;
+    size_t frameBytes = channels * (bits / 8);
+    const size_t blockLen = STREAM_BLOCK_LEN * workerPoolSize();
+    size_t stride = 0;
+    void *block = samplesAlloc(blockLen, channels, sampleSize(p), &stride);
+
+    /* the peak only needs to be searched for within a single period, which
+       the full duration is used for when none is found */
+    size_t period = wavePeriodLength(p);
+    if (period == 0 || period > total) period = total;
+
+    double gains[MAX_CHANNELS];
+    bool predicted = peakPredict(p, period, total, gains);
+    if (!predicted) {
+        loggerAppend(LOG_INFO, "scanning %zu samples for the wave's peak",
+            period);
+    }
+
+    for (size_t c = 0; c < channels && !predicted; c++) {
+        double posPeak = 0.0, negPeak = 0.0;
+        for (size_t start = 0; start < period; start += blockLen) {
+            size_t n = period - start;
+            if (n > blockLen) n = blockLen;
+
+            waveRender(p, &p->channels[c], block, start, n);
+            bufferPeaks(block, n, samplePrecision(p), &posPeak, &negPeak);
+        }
+
+        gains[c] = peakToGain(&p->channels[c], posPeak, negPeak);
+    }
+
+    bool dither = p->sampleFormat == FMT_INT_PCM && p->applyDither;
+    loggerAppend(LOG_INFO, "streaming %zu samples in blocks of %zu",
+        total, blockLen);
+    for (size_t start = 0; start < total; start += blockLen) {
+        size_t n = total - start;
+        if (n > blockLen) n = blockLen;
+
+        for (size_t c = 0; c < channels; c++) {
+            void *plane = sampleAt(p, block, c * stride);
+            waveRender(p, &p->channels[c], plane, start, n);
+            if (dither) applyDither(p, c, plane, start, n, gains[c]);
+        }
+
+        void *dst = outputAcquire(out, n * frameBytes);
+        quantizeBuffer(p, block, stride, dither ? NULL : gains, dst, n);
+        if (machineIsBigEndian()) {
+            convertToLittleEndian(dst, n * channels, bits);
+        }
+
+        outputCommit(out, n * frameBytes);
+    }
+
+    samplesFree(block);
+}
+
+/* finished chunks are kept as '<key>.chunk' files, a header followed by the
+   chunk's (little-endian) frames, where the key hashes everything that
+   shapes those bytes; a file's modification time is when it was last used,
+   and the least recently used ones go once they take up too much space */
+
+/* bumped whenever the same parameters come to render different samples */
+#define CHUNK_CACHE_VERSION 1
+#define CHUNK_CACHE_MAGIC "WGCHUNK1"
+#define CHUNK_CACHE_SUFFIX ".chunk"
+#define FNV_OFFSET 0xCBF29CE484222325ull
+#define FNV_PRIME 0x100000001B3ull
+
+typedef struct ChunkCacheHeader {
+    char magic[8];
+    uint64_t key;
+    uint64_t sampleCount;
+    uint64_t bytesPerFrame;
+} ChunkCacheHeader;
+
+/* a chunk mapped out of the cache */
+typedef struct CachedChunk {
+    void *map;
+    size_t size;
+    const uint8_t *frames;
+    size_t sampleCount;
+} CachedChunk;
+
+/* FNV-1a over the little-endian bytes of 'v', so keys match across hosts */
+uint64_t hashU64(uint64_t h, uint64_t v)
+{
+    for (size_t i = 0; i < 8; i++) {
+        h ^= (v >> (8 * i)) & 0xFF;
+        h *= FNV_PRIME;
+    }
+
+    return h;
+}
+
+uint64_t hashDouble(uint64_t h, double v)
+{
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return hashU64(h, bits);
+}
+
+/* everything the chunk's bytes depend on, normalized so that settings which
+   don't change them (dither in floating-point mode, a duration longer than
+   the chunk, the threads or the output backend) don't change the key */
+uint64_t chunkCacheKey(const Parameters *p)
+{
+    bool dither = p->sampleFormat == FMT_INT_PCM && p->applyDither;
+    uint64_t h = hashU64(FNV_OFFSET, CHUNK_CACHE_VERSION);
+    h = hashU64(h, waveChunkLength(p));
+    h = hashU64(h, p->sampleRate);
+    h = hashU64(h, p->bitsPerSample);
+    h = hashU64(h, p->sampleFormat);
+    h = hashU64(h, dither);
+    h = hashU64(h, dither ? p->ditherSeed : 0);
+    h = hashU64(h, p->oscillator);
+    h = hashU64(h, p->synthesis);
+    h = hashU64(h, p->peakMode);
+    h = hashU64(h, samplePrecision(p));
+    h = hashU64(h, p->channelCount);
+    for (size_t c = 0; c < p->channelCount; c++) {
+        const Channel *ch = &p->channels[c];
+        h = hashU64(h, ch->waveType);
+        h = hashDouble(h, ch->amplitude);
+        h = hashU64(h, ch->freqCount);
+        for (size_t i = 0; i < ch->freqCount; i++) {
+            h = hashDouble(h, ch->freqs[i]);
+        }
+    }
+
+    return h;
+}
+
+void chunkCachePath(const Parameters *p, uint64_t key, char *path)
+{
+    snprintf(path, NAME_MAX, "%s/%016llx" CHUNK_CACHE_SUFFIX, p->cacheDir,
+        (unsigned long long)key);
+}
+
+/* maps the chunk cached for 'p', if there is a complete one */
+bool chunkCacheLoad(const Parameters *p, CachedChunk *c)
+{
+    memset(c, 0, sizeof(*c));
+#if defined _WIN32
+    (void)p;
+    return false;
+#else
+    if (p->cacheDir == NULL) return false;
+
+    char path[NAME_MAX];
+    uint64_t key = chunkCacheKey(p);
+    chunkCachePath(p, key, path);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    ChunkCacheHeader header;
+    struct stat st;
+    size_t frame = p->channelCount * (p->bitsPerSample / 8);
+    bool valid = fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(header) &&
+        read(fd, &header, sizeof(header)) == sizeof(header) &&
+        memcmp(header.magic, CHUNK_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+        header.key == key && header.bytesPerFrame == frame &&
+        header.sampleCount == waveChunkLength(p) &&
+        (size_t)st.st_size == sizeof(header) + header.sampleCount * frame;
+    void *map = valid ? mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED,
+        fd, 0) : MAP_FAILED;
+    if (map != MAP_FAILED) {
+        /* a use is what keeps it from being evicted */
+        futimens(fd, NULL);
+    }
+
+    close(fd);
+    if (map == MAP_FAILED) {
+        loggerAppend(ERR_READ, "ignoring cached chunk '%s' (%s)", path,
+            valid ? strerror(errno) : "incomplete or from other parameters");
+        return false;
+    }
+
+    c->map = map;
+    c->size = (size_t)st.st_size;
+    c->frames = (const uint8_t*)map + sizeof(header);
+    c->sampleCount = header.sampleCount;
+    loggerAppend(LOG_INFO, "reusing cached chunk '%s' (%zu samples)", path,
+        c->sampleCount);
+    return true;
+#endif
+}
+
+void chunkCacheRelease(CachedChunk *c)
+{
+#if !defined _WIN32
+    if (c->map != NULL) munmap(c->map, c->size);
+#endif
+    memset(c, 0, sizeof(*c));
+}
+
+#if !defined _WIN32
+typedef struct CacheEntry {
+    char name[CHUNK_CACHE_NAME_MAX];
+    uint64_t size;
+    struct timespec used;
+} CacheEntry;
+
+int cacheEntryCompare(const void *a, const void *b)
+{
+    const CacheEntry *x = a, *y = b;
+    if (x->used.tv_sec != y->used.tv_sec) {
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    }
+
+    return x->used.tv_nsec < y->used.tv_nsec ? -1 :
+        x->used.tv_nsec > y->used.tv_nsec;
+}
+
+/* removes the least recently used chunks until the rest fit in the limit */
+void chunkCacheEvict(const Parameters *p)
+{
+    DIR *dir = opendir(p->cacheDir);
+    if (dir == NULL) return;
+
+    CacheEntry *entries = NULL;
+    size_t count = 0, cap = 0;
+    uint64_t total = 0;
+    char path[NAME_MAX];
+    struct dirent *e;
+    while ((e = readdir(dir)) != NULL) {
+        size_t len = strlen(e->d_name), suffix = strlen(CHUNK_CACHE_SUFFIX);
+        struct stat st;
+        if (len < suffix || len >= CHUNK_CACHE_NAME_MAX ||
+            strcmp(e->d_name + len - suffix, CHUNK_CACHE_SUFFIX) != 0 ||
+            fstatat(dirfd(dir), e->d_name, &st, 0) != 0 ||
+            !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        if (count == cap) {
+            cap = cap > 0 ? 2 * cap : 64;
+            CacheEntry *grown = realloc(entries, cap * sizeof(*entries));
+            if (grown == NULL) {
+                ERR_OUT_OF_MEMORY();
+                exit(EXIT_FAILURE);
+            }
+
+            entries = grown;
+        }
+
+        CacheEntry *entry = &entries[count++];
+        memcpy(entry->name, e->d_name, len + 1);
+        entry->size = (uint64_t)st.st_size;
+        entry->used = st.st_mtim;
+        total += entry->size;
+    }
+
+    closedir(dir);
+    if (total > p->cacheLimit) {
+        qsort(entries, count, sizeof(*entries), cacheEntryCompare);
+    }
+
+    for (size_t i = 0; i < count && total > p->cacheLimit; i++) {
+        snprintf(path, sizeof(path), "%s/%s", p->cacheDir, entries[i].name);
+        if (unlink(path) == 0) {
+            loggerAppend(LOG_INFO, "evicted cached chunk '%s'", path);
+            total -= entries[i].size;
+        } else if (errno == ENOENT) {
+            total -= entries[i].size; // another run got to it first
+        }
+    }
+
+    free(entries);
+}
+#endif
+
+/* keeps a finished chunk of 'sampleCount' samples for later runs, writing it
+   under a temporary name first so that it only ever shows up complete */
+void chunkCacheStore(const Parameters *p, const void *frames,
+    size_t sampleCount)
+{
+#if defined _WIN32
+    (void)p, (void)frames, (void)sampleCount;
+#else
+    if (p->cacheDir == NULL) return;
+
+    size_t frame = p->channelCount * (p->bitsPerSample / 8);
+    ChunkCacheHeader header = {
+        .key = chunkCacheKey(p),
+        .sampleCount = sampleCount,
+        .bytesPerFrame = frame,
+    };
+    memcpy(header.magic, CHUNK_CACHE_MAGIC, sizeof(header.magic));
+    if (sizeof(header) + sampleCount * frame > p->cacheLimit) {
+        loggerAppend(LOG_INFO, "the chunk is larger than the cache limit"
+            " (not caching it)");
+        return;
+    }
+
+    char path[NAME_MAX], temp[NAME_MAX];
+    chunkCachePath(p, header.key, path);
+    snprintf(temp, sizeof(temp), "%s/chunk-XXXXXX", p->cacheDir);
+    mkdir(p->cacheDir, 0755);
+    int fd = mkstemp(temp);
+    FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    bool stored = f != NULL &&
+        fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(frames, frame, sampleCount, f) == sampleCount;
+    if (f != NULL) {
+        stored = fclose(f) == 0 && stored;
+    } else if (fd >= 0) {
+        close(fd);
+    }
+
+    if (stored) stored = chmod(temp, 0644) == 0 && rename(temp, path) == 0;
+    if (!stored) {
+        loggerAppend(ERR_ARG, "unable to cache the chunk in '%s': %s",
+            p->cacheDir, strerror(errno));
+        if (fd >= 0) unlink(temp);
+        return;
+    }
+
+    loggerAppend(LOG_INFO, "cached the chunk as '%s'", path);
+    chunkCacheEvict(p);
+#endif
+}
+
+/* writes the wave by repeating its base chunk, which gets quantized straight
+   into the output (and copied from there) when it is memory-mapped */
+void waveChunkWrite(const Parameters *p, Output *out)
+{
+    size_t total = waveSampleCount(p);
+    size_t bytes = p->channelCount * (p->bitsPerSample / 8); // per frame
+    AudioBuffer buf = {0};
+    CachedChunk cached;
+    const uint8_t *chunk = NULL;
+    size_t chunkLen = 0, written = 0;
+    if (chunkCacheLoad(p, &cached)) {
+        chunk = cached.frames, chunkLen = cached.sampleCount;
+    } else if (out->map != NULL) {
+        WaveChunk w = waveChunkPrepare(p);
+        chunkLen = w.sampleCount < total ? w.sampleCount : total;
+        uint8_t *dst = outputAcquire(out, chunkLen * bytes);
+        quantizeBuffer(p, w.buf, w.plane, w.gains, dst, chunkLen);
+        if (machineIsBigEndian()) {
+            convertToLittleEndian(dst, chunkLen * p->channelCount,
+                p->bitsPerSample);
+        }
+
+        /* (a chunk cut short by the duration isn't worth keeping) */
+        if (chunkLen == w.sampleCount) chunkCacheStore(p, dst, chunkLen);
+        outputCommit(out, chunkLen * bytes);
+        samplesFree(w.buf);
+        chunk = dst, written = chunkLen;
+    } else {
+        buf = audioBufferBuild(p);
+        chunk = buf.buf, chunkLen = buf.sampleCount;
+        chunkCacheStore(p, chunk, chunkLen);
+    }
+
+    while (written < total) {
+        size_t n = total - written;
+        if (n > chunkLen) n = chunkLen;
+
+        outputWrite(out, chunk, n * bytes);
+        written += n;
+    }
+
+    chunkCacheRelease(&cached);
+    audioBufferDestroy(&buf);
+}
+
+#define CHUNK_MEMORY_BUDGET (256 * KB * KB)
+
+/* writes the wave's samples (everything past the header), streaming them
+   when the chunk that would be repeated doesn't fit the memory budget */
+void waveWrite(const Parameters *p, Output *out)
+{
+    size_t chunkBytes = waveChunkLength(p) * p->channelCount * sampleSize(p);
+    if (p->renderMode == RENDER_CHUNK && waveIsAperiodic(p)) {
+        loggerAppend(LOG_INFO, "the wave never repeats"
+            " (streaming it instead)");
+        waveStreamWrite(p, out);
+    } else if (p->renderMode == RENDER_CHUNK &&
+        chunkBytes > CHUNK_MEMORY_BUDGET) {
+        loggerAppend(LOG_INFO, "the wave's period needs %zuMB as a chunk"
+            " (streaming it instead)", chunkBytes / KB / KB);
+        waveStreamWrite(p, out);
+    } else if (p->renderMode == RENDER_STREAM) {
+        waveStreamWrite(p, out);
+    } else {
+        waveChunkWrite(p, out);
+    }
+}
+
+#define BATCH_LOG_FILE_NAME "batch.jsonl"
+#define BATCH_SECTION_NAME_MAX 256
+
+typedef struct BatchJob {
+    char name[BATCH_SECTION_NAME_MAX];
+    ConfigLines lines;
+    Parameters p;
+    bool ok;
+    char error[KB];
+    char warnings[KB]; // the config's rejected keys
+    size_t bytes;
+    double seconds;
+} BatchJob;
+
+typedef struct BatchContext {
+    BatchJob *jobs;
+    FILE *log;
+} BatchContext;
+
+/* copies 'src' into 'dst' as the contents of a JSON string */
+void jsonEscape(char *dst, size_t size, const char *src)
+{
+    size_t n = 0;
+    for (; *src != '\0' && n + 7 < size; src++) {
+        unsigned char c = (unsigned char)*src;
+        if (c == '"' || c == '\\') {
+            dst[n++] = '\\', dst[n++] = (char)c;
+        } else if (c < 0x20) {
+            n += snprintf(dst + n, size - n, "\\u%04x", c);
+        } else {
+            dst[n++] = (char)c;
+        }
+    }
+
+    dst[n] = '\0';
+}
+
+/* orders jobs by output file, and the jobs of one file by their position */
+int batchJobCompare(const void *a, const void *b)
+{
+    const BatchJob *x = *(BatchJob *const *)a, *y = *(BatchJob *const *)b;
+    int order = strcmp(x->p.outputFile, y->p.outputFile);
+    return order != 0 ? order : (x > y) - (x < y);
+}
+
+/* fails every job that would write to the same file as an earlier one,
+   since jobs run at the same time and one would truncate the file under
+   the other */
+void batchRejectCollisions(BatchJob *jobs, size_t count)
+{
+    BatchJob **sorted = malloc(count * sizeof(*sorted));
+    if (sorted == NULL && count > 0) {
+        ERR_OUT_OF_MEMORY();
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < count; i++) sorted[i] = &jobs[i];
+    qsort(sorted, count, sizeof(*sorted), batchJobCompare);
+    for (size_t i = 1; i < count; i++) {
+        BatchJob *first = sorted[i - 1];
+        while (i < count &&
+            strcmp(first->p.outputFile, sorted[i]->p.outputFile) == 0) {
+            snprintf(sorted[i]->error, sizeof(sorted[i]->error),
+                "job '%s' already writes to this file", first->name);
+            i++;
+        }
+    }
+
+    free(sorted);
+}
+
+/* appends the job's outcome to the batch log as a single JSON line */
+void batchJobLog(FILE *log, const BatchJob *job)
+{
+    char name[2 * BATCH_SECTION_NAME_MAX], file[2 * NAME_MAX], error[2 * KB];
+    char warnings[2 * KB];
+    jsonEscape(name, sizeof(name), job->name);
+    jsonEscape(file, sizeof(file), job->p.outputFile);
+    jsonEscape(error, sizeof(error), job->error);
+    jsonEscape(warnings, sizeof(warnings), job->warnings);
+
+    /* the keys the job's config had rejected (and fell back from) */
+    char rejected[2 * KB + 16] = "";
+    if (*warnings != '\0') {
+        snprintf(rejected, sizeof(rejected), ",\"warnings\":\"%s\"",
+            warnings);
+    }
+
+    char line[8 * KB];
+    if (job->ok) {
+        snprintf(line, sizeof(line), "{\"job\":\"%s\",\"status\":\"ok\","
+            "\"file\":\"%s\",\"frames\":%zu,\"channels\":%u,"
+            "\"bytes\":%zu,\"seconds\":%.6f%s}\n", name, file,
+            waveSampleCount(&job->p), job->p.channelCount, job->bytes,
+            job->seconds, rejected);
+    } else {
+        snprintf(line, sizeof(line), "{\"job\":\"%s\",\"status\":\"failed\","
+            "\"file\":\"%s\",\"error\":\"%s\"%s}\n", name, file, error,
+            rejected);
+    }
+
+    /* a single write per line keeps lines from concurrent jobs whole */
+    fputs(line, log);
+    fflush(log);
+}
+
+void batchJobRun(BatchJob *job)
+{
+    const Parameters *p = &job->p;
+    double start = monotonicSeconds();
+    WavHeader header = wavHeaderBuild(p);
+    uint8_t headerBytes[WAV_HEADER_MAX];
+    size_t headerSize = wavHeaderSerialize(&header, headerBytes);
+    size_t fileSize = headerSize + (size_t)header.dataSize;
+
+    Output out;
+    if (job->error[0] != '\0') return; // rejected before the batch started
+
+    if (!outputTryOpen(&out, p->outputFile, fileSize, p->outputBackend)) {
+        snprintf(job->error, sizeof(job->error),
+            "unable to open file for writing: %s", strerror(errno));
+        return;
+    }
+
+    outputWrite(&out, headerBytes, headerSize);
+    waveWrite(p, &out);
+    outputClose(&out);
+    job->ok = true;
+    job->bytes = fileSize;
+    job->seconds = monotonicSeconds() - start;
+}
+
+void batchTask(void *ctx, size_t tile, size_t start, size_t len)
+{
+    (void)tile;
+    BatchContext *batch = ctx;
+    for (size_t i = start; i < start + len; i++) {
+        batchJobRun(&batch->jobs[i]);
+        batchJobLog(batch->log, &batch->jobs[i]);
+    }
+}
+
+/* splits the manifest into jobs: every '[name]' section starts one, made of
+   the config file's keys, then those before the first section, then its own
+   (with the output file named after the section unless it says otherwise) */
+BatchJob *batchManifestParse(const char *file, char *text,
+    const ConfigLines *base, size_t *count)
+{
+    ConfigLines shared = *base;
+    BatchJob *jobs = NULL;
+    size_t len = 0, cap = 0;
+    char *parserState = NULL;
+    char *line = strtok_r(text, LINE_DELIMS, &parserState);
+    for (; line != NULL; line = strtok_r(NULL, LINE_DELIMS, &parserState)) {
+        stripChars(line, isspace);
+        char *end = strchr(line, ']');
+        if (*line != '[' || end == NULL) {
+            char name[BATCH_SECTION_NAME_MAX + NAME_MAX + 4];
+            if (len == 0) {
+                configCollect(file, line, &shared);
+            } else {
+                snprintf(name, sizeof(name), "%s [%s]", file,
+                    jobs[len - 1].name);
+                BatchJob *job = &jobs[len - 1];
+                loggerScope(NULL, job->warnings, sizeof(job->warnings));
+                configCollect(name, line, &job->lines);
+                loggerScope(NULL, NULL, 0);
+            }
+
+            continue;
+        }
+
+        *end = '\0';
+        stripChars(++line, isspace);
+        if (len == cap) {
+            cap = cap ? cap * 2 : 16;
+            BatchJob *grown = realloc(jobs, cap * sizeof(*jobs));
+            if (grown == NULL) {
+                ERR_OUT_OF_MEMORY();
+                exit(EXIT_FAILURE);
+            }
+
+            jobs = grown;
+        }
+
+        BatchJob *job = &jobs[len++];
+        memset(job, 0, sizeof(*job));
+        if (*line == '\0') {
+            snprintf(job->name, sizeof(job->name), "job%zu", len);
+        } else {
+            snprintf(job->name, sizeof(job->name), "%s", line);
+        }
+
+        job->lines = shared;
+        job->lines.lines[LINE_OUTPUT_FILE] = NULL;
+    }
+
+    /* (only now that the array has stopped moving around) */
+    for (size_t i = 0; i < len; i++) {
+        ConfigLines *lines = &jobs[i].lines;
+        if (lines->lines[LINE_OUTPUT_FILE] == NULL) {
+            lines->lines[LINE_OUTPUT_FILE] = jobs[i].name;
+        }
+    }
+
+    *count = len;
+    return jobs;
+}
+
+/* runs every job of the manifest across the worker pool (one job per thread,
+   each rendered single-threaded), reusing the wavetables they have in common,
+   and logs their outcomes to BATCH_LOG_FILE_NAME */
+int batchRun(const char *manifest, long threadCount, SimdLevel simd)
+{
+    double parseStart = spanBegin();
+    ConfigLines base = {0};
+    char *configBuf = NULL;
+    FILE *f = fopen("config.cfg", "r");
+    if (f != NULL) {
+        configBuf = readFileContents("config.cfg", f);
+        fclose(f);
+        if (configBuf != NULL) configCollect("config.cfg", configBuf, &base);
+    } else {
+        loggerAppend(ERR_READ, "unable to read config file '%s': %s",
+            "config.cfg", strerror(errno));
+    }
+
+    f = fopen(manifest, "r");
+    char *manifestBuf = f != NULL ? readFileContents(manifest, f) : NULL;
+    if (f != NULL) fclose(f);
+    if (manifestBuf == NULL) {
+        loggerAppend(ERR_READ, "unable to read batch manifest '%s': %s",
+            manifest, f == NULL ? strerror(errno) : "empty file");
+        free(configBuf);
+        return EXIT_FAILURE;
+    }
+
+    size_t jobCount = 0;
+    BatchJob *jobs = batchManifestParse(manifest, manifestBuf, &base,
+        &jobCount);
+    spanEnd(SPAN_PARSE, parseStart);
+
+    /* the pool is sized by the config file (or '--threads') alone */
+    Parameters baseParams = configApply(&base);
+    workerPoolInit(threadCount >= 0 ? (size_t)threadCount :
+        baseParams.threadCount);
+    parametersDestroy(&baseParams);
+    simdInit(simd);
+    parseStart = spanBegin();
+    for (size_t i = 0; i < jobCount; i++) {
+        char label[BATCH_SECTION_NAME_MAX + NAME_MAX + 4];
+        BatchJob *job = &jobs[i];
+        snprintf(label, sizeof(label), "%s [%s]", manifest, job->name);
+        loggerScope(label, job->warnings, sizeof(job->warnings));
+        job->p = configApply(&job->lines);
+        loggerScope(NULL, NULL, 0);
+    }
+
+    batchRejectCollisions(jobs, jobCount);
+    spanEnd(SPAN_PARSE, parseStart);
+
+    FILE *log = fopen(BATCH_LOG_FILE_NAME, "w");
+    if (log == NULL) {
+        loggerAppend(ERR_FATAL, "unable to open '%s' for writing: %s",
+            BATCH_LOG_FILE_NAME, strerror(errno));
+        loggerClose(errno);
+        exit(EXIT_FAILURE);
+    }
+
+    loggerAppend(LOG_INFO, "running %zu job(s) from '%s' on %zu thread(s)",
+        jobCount, manifest, workerPoolSize());
+    double start = monotonicSeconds();
+    BatchContext batch = { .jobs = jobs, .log = log };
+    loggerQuiet(true);
+    parallelTasks(jobCount, batchTask, &batch);
+    loggerQuiet(false);
+
+    size_t failed = 0;
+    for (size_t i = 0; i < jobCount; i++) {
+        if (!jobs[i].ok) {
+            loggerAppend(ERR_ARG, "job '%s' failed: %s", jobs[i].name,
+                jobs[i].error);
+            failed += 1;
+        }
+
+        parametersDestroy(&jobs[i].p);
+    }
+
+    loggerAppend(LOG_INFO, "%zu of %zu job(s) written in %.2lfs (see '%s')",
+        jobCount - failed, jobCount, monotonicSeconds() - start,
+        BATCH_LOG_FILE_NAME);
+
+    fclose(log);
+    free(jobs);
+    free(manifestBuf);
+    free(configBuf);
+    return failed ? EXIT_FAILURE : 0;
+}
+
+#define BENCH_REPEATS 3
+#define BENCH_SLOW_SECS 1.0
+#define BENCH_TEMP_FILE "wavgen_bench.tmp"
+
+static const char *benchFreqs = "55, 440, 3520";
+static const char *benchRates = "44100, 96000";
+static const char *benchDurations = "1, 10";
+
+typedef struct BenchReport {
+    FILE *out;
+    size_t count;
+} BenchReport;
+
+/* appends one result to the report, where 'fields' holds the stage-specific
+   (already JSON-formatted) keys */
+void benchResult(BenchReport *r, const char *stage, const char *fields,
+    size_t samples, size_t bytes, double secs)
+{
+    fprintf(r->out, "%s\n    {\"stage\":\"%s\",%s\"samples\":%zu,"
+        "\"time\":%.9f,\"samples_per_sec\":%.1f,\"mb_per_sec\":%.2f}",
+        r->count++ ? "," : "", stage, fields, samples, secs,
+        samples / secs, bytes / secs / KB / KB);
+}
+
+/* splits a comma-separated list of numbers from the command line */
+double *benchList(const char *arg, size_t *len)
+{
+    char *copy = configLineDup(arg);
+    double *list = parseFreqList(copy, len);
+    free(copy);
+    if (list == NULL) {
+        loggerAppend(ERR_ARG, "no valid numbers in '%s'", arg);
+        loggerClose(EXIT_FAILURE);
+        exit(EXIT_FAILURE);
+    }
+
+    return list;
+}
+
+/* times the pipeline's stages (synthesis per wave type and noise color, a
+   chord rendered block by block against tile by tile, peak search, dither,
+   quantization per sample format in both precisions and writing out per
+   backend) over a matrix of frequencies, sample rates and durations (set by
+   '--freqs', '--rates' and '--durations', next to '--threads' and '--simd'),
+   keeping the best of BENCH_REPEATS runs, and prints the results to stdout
+   as JSON */
+int benchRun(int argc, char **argv)
+{
+    const char *freqArg = benchFreqs, *rateArg = benchRates;
+    const char *durationArg = benchDurations;
+    long threadCount = 0;
+    SimdLevel simd = SIMD_AUTO;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--freqs") == 0 && i + 1 < argc) {
+            freqArg = argv[++i];
+        } else if (strcmp(argv[i], "--rates") == 0 && i + 1 < argc) {
+            rateArg = argv[++i];
+        } else if (strcmp(argv[i], "--durations") == 0 && i + 1 < argc) {
+            durationArg = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            long count = parseThreadCount(argv[++i]);
+            if (count >= 0) threadCount = count;
+        } else if (strcmp(argv[i], "--simd") == 0 && i + 1 < argc) {
+            simd = parseSimdLevel(argv[++i]);
+        } else {
+            loggerAppend(ERR_ARG,
+                "unrecognized argument '%s' (ignoring)", argv[i]);
+        }
+    }
+
+    size_t freqCount = 0, rateCount = 0, durationCount = 0;
+    double *freqs = benchList(freqArg, &freqCount);
+    double *rates = benchList(rateArg, &rateCount);
+    double *durations = benchList(durationArg, &durationCount);
+    workerPoolInit((size_t)threadCount);
+    simdInit(simd);
+
+    ConfigLines defaults = {0};
+    Parameters p = configApply(&defaults);
+    p.applyDither = false;
+    BenchReport r = { .out = stdout };
+    int code = 0; // failed if the renders that must match don't
+    printf("{\n  \"simd\":\"%s\",\n  \"threads\":%zu,\n  \"results\":[",
+        simdLevelToString(simdLevel), workerPoolSize());
+    loggerAppend(LOG_INFO, "benchmarking %zu frequencies x %zu rates x %zu"
+        " durations", freqCount, rateCount, durationCount);
+
+    char fields[KB];
+    for (size_t ri = 0; ri < rateCount; ri++) {
+        for (size_t di = 0; di < durationCount; di++) {
+            p.sampleRate = (uint32_t)rates[ri];
+            p.durationSecs = durations[di];
+            size_t len = waveSampleCount(&p), unused = 0;
+            void *buf = samplesAlloc(len, 1, sizeof(double), &unused);
+            uint8_t *pcm = malloc(len * sizeof(double));
+            if (pcm == NULL) {
+                ERR_OUT_OF_MEMORY();
+                exit(EXIT_FAILURE);
+            }
+
+            loggerAppend(LOG_INFO, "* %uHz, %.2lfs", p.sampleRate,
+                p.durationSecs);
+            for (int prec = PRECISION_FLOAT; prec <= PRECISION_DOUBLE;
+                prec++) {
+                p.precision = prec;
+                p.sampleFormat = FMT_INT_PCM;
+                p.bitsPerSample = 24;
+                const char *precision = samplePrecisionToString(prec);
+                size_t size = sampleSize(&p);
+                for (size_t fi = 0; fi < freqCount; fi++) {
+                    if (freqs[fi] * 2.0 >= p.sampleRate) continue;
+
+                    for (int type = WAVE_SINE; type <= WAVE_EVEN; type++) {
+                        for (int synth = SYNTH_WAVETABLE; synth <= SYNTH_EXACT;
+                            synth++) {
+                            /* sines are always rendered the same way */
+                            if (type == WAVE_SINE && synth == SYNTH_WAVETABLE) {
+                                continue;
+                            }
+
+                            Channel ch = {
+                                .freqs = &freqs[fi],
+                                .freqCount = 1,
+                                .waveType = type,
+                            };
+
+                            p.synthesis = synth;
+                            double best = HUGE_VAL;
+                            /* slow renders (exact synthesis of high tones) are
+                               measured once, they are not noise-bound anyway */
+                            for (size_t k = 0; k < BENCH_REPEATS &&
+                                (k == 0 || best < BENCH_SLOW_SECS); k++) {
+                                double t = monotonicSeconds();
+                                waveRender(&p, &ch, buf, 0, len);
+                                t = monotonicSeconds() - t;
+                                if (t < best) best = t;
+                            }
+
+                            snprintf(fields, sizeof(fields), "\"wave\":\"%s\","
+                                "\"synthesis\":\"%s\",\"freq\":%.3f,"
+                                "\"rate\":%u,\"precision\":\"%s\",",
+                                waveTypeToString(type),
+                                synth == SYNTH_EXACT ? "exact" : "wavetable",
+                                freqs[fi], p.sampleRate, precision);
+                            benchResult(&r, "render", fields, len, len * size,
+                                best);
+                        }
+                    }
+                }
+
+                /* noise doesn't depend on the frequency either */
+                for (int type = WAVE_WHITE_NOISE; type <= WAVE_BAND_NOISE;
+                    type++) {
+                    Channel ch = { .waveType = type };
+                    double best = HUGE_VAL;
+                    for (size_t k = 0; k < BENCH_REPEATS; k++) {
+                        double t = monotonicSeconds();
+                        waveRender(&p, &ch, buf, 0, len);
+                        t = monotonicSeconds() - t;
+                        if (t < best) best = t;
+                    }
+
+                    snprintf(fields, sizeof(fields), "\"wave\":\"%s\","
+                        "\"rate\":%u,\"precision\":\"%s\",",
+                        waveTypeToString(type), p.sampleRate, precision);
+                    benchResult(&r, "render", fields, len, len * size, best);
+                }
+
+                /* a chord of every frequency, rendered a block at a time and
+                   then a whole tile at a time, which streams the buffer
+                   through memory once (or once more per tone, besides
+                   clearing it) */
+                Channel chord = { .freqs = freqs, .waveType = WAVE_SAW };
+                while (chord.freqCount < freqCount &&
+                    freqs[chord.freqCount] * 2.0 < p.sampleRate) {
+                    chord.freqCount += 1;
+                }
+
+                for (int synth = SYNTH_WAVETABLE; synth <= SYNTH_EXACT &&
+                    prec == PRECISION_DOUBLE && chord.freqCount > 1; synth++) {
+                    p.synthesis = synth;
+                    for (int tiled = 1; tiled >= 0; tiled--) {
+                        void *dst = tiled ? buf : (void*)pcm;
+                        renderBlockLen = tiled ? RENDER_SCRATCH_LEN : 0;
+                        double best = HUGE_VAL;
+                        for (size_t k = 0; k < BENCH_REPEATS &&
+                            (k == 0 || best < BENCH_SLOW_SECS); k++) {
+                            double t = monotonicSeconds();
+                            waveRender(&p, &chord, dst, 0, len);
+                            t = monotonicSeconds() - t;
+                            if (t < best) best = t;
+                        }
+
+                        /* not measured: what the buffer would stream if
+                           every pass over it missed the cache */
+                        size_t passes = tiled ? 1 : chord.freqCount + 1;
+                        snprintf(fields, sizeof(fields), "\"order\":\"%s\","
+                            "\"synthesis\":\"%s\",\"tones\":%zu,\"rate\":%u,"
+                            "\"precision\":\"%s\",\"modeled_mb\":%.1f,",
+                            tiled ? "tiled" : "untiled",
+                            synth == SYNTH_EXACT ? "exact" : "wavetable",
+                            chord.freqCount, p.sampleRate, precision,
+                            (double)(passes * len * size) / KB / KB);
+                        benchResult(&r, "tiling", fields, len, len * size,
+                            best);
+                    }
+
+                    renderBlockLen = RENDER_SCRATCH_LEN;
+                    if (memcmp(buf, pcm, len * size) != 0) {
+                        loggerAppend(ERR_FATAL, "tiled and untiled %s renders"
+                            " differ", synth == SYNTH_EXACT ? "exact" :
+                            "wavetable");
+                        code = EXIT_FAILURE;
+                    }
+                }
+
+                /* the remaining stages only depend on the amount of samples */
+                snprintf(fields, sizeof(fields),
+                    "\"rate\":%u,\"precision\":\"%s\",", p.sampleRate,
+                    precision);
+                double best = HUGE_VAL, gain = 1.0;
+                for (size_t k = 0; k < BENCH_REPEATS; k++) {
+                    double t = monotonicSeconds();
+                    double posPeak = 0.0, negPeak = 0.0;
+                    bufferPeaks(buf, len, prec, &posPeak, &negPeak);
+                    gain = peakToGain(&p.channels[0], posPeak, negPeak);
+                    t = monotonicSeconds() - t;
+                    if (t < best) best = t;
+                }
+
+                benchResult(&r, "peak", fields, len, len * size, best);
+
+                /* normalizing once, then dithering by a gain of 1 from then
+                   on */
+                best = HUGE_VAL;
+                for (size_t k = 0; k < BENCH_REPEATS; k++) {
+                    double t = monotonicSeconds();
+                    applyDither(&p, 0, buf, 0, len, k == 0 ? gain : 1.0);
+                    t = monotonicSeconds() - t;
+                    if (t < best) best = t;
+                }
+
+                benchResult(&r, "dither", fields, len, len * size, best);
+
+                static const struct {
+                    SampleFormat format;
+                    uint32_t bits;
+                } formats[] = {
+                    { FMT_INT_PCM, 8 }, { FMT_INT_PCM, 16 },
+                    { FMT_INT_PCM, 24 }, { FMT_INT_PCM, 32 },
+                    { FMT_FLOAT_PCM, 32 }, { FMT_FLOAT_PCM, 64 }
+                };
+
+                for (size_t f = 0; f < sizeof(formats) / sizeof(*formats);
+                    f++) {
+                    p.sampleFormat = formats[f].format;
+                    p.bitsPerSample = formats[f].bits;
+                    /* (formats that always take double samples only once) */
+                    if ((int)samplePrecision(&p) != prec) continue;
+
+                    best = HUGE_VAL;
+                    for (size_t k = 0; k < BENCH_REPEATS; k++) {
+                        double t = monotonicSeconds();
+                        quantizeBuffer(&p, buf, len, NULL, pcm, len);
+                        t = monotonicSeconds() - t;
+                        if (t < best) best = t;
+                    }
+
+                    snprintf(fields, sizeof(fields), "\"format\":\"%s\","
+                        "\"bits\":%u,\"rate\":%u,\"precision\":\"%s\",",
+                        p.sampleFormat == FMT_INT_PCM ? "int" : "float",
+                        p.bitsPerSample, p.sampleRate, precision);
+                    benchResult(&r, "quantize", fields, len,
+                        len * p.bitsPerSample / 8, best);
+                }
+            }
+
+            /* 24-bit output through each backend, to a scratch file */
+            size_t bytes = len * 3;
+            loggerQuiet(true);
+            for (int b = OUT_STDIO; b <= OUT_URING; b++) {
+                double best = HUGE_VAL;
+                for (size_t k = 0; k < BENCH_REPEATS; k++) {
+                    double t = monotonicSeconds();
+                    Output out = outputOpen(BENCH_TEMP_FILE, bytes, b);
+                    outputWrite(&out, pcm, bytes);
+                    outputClose(&out);
+                    t = monotonicSeconds() - t;
+                    if (t < best) best = t;
+                }
+
+                snprintf(fields, sizeof(fields), "\"backend\":\"%s\","
+                    "\"bits\":24,\"rate\":%u,", outputBackendToString(b),
+                    p.sampleRate);
+                benchResult(&r, "write", fields, len, bytes, best);
+            }
+
+            loggerQuiet(false);
+            remove(BENCH_TEMP_FILE);
+            samplesFree(buf);
+            free(pcm);
+        }
+    }
+
+    printf("\n  ]\n}\n");
+    p.channels[0].freqs = NULL;
+    parametersDestroy(&p);
+    free(freqs);
+    free(rates);
+    free(durations);
+    return code;
+}
+
+size_t waveSampleCount(const Parameters *p)
+{
+    return (size_t)(p->sampleRate * p->durationSecs);
+}
+
+bool outputMap(Output *o);
+bool outputRingOpen(Output *o, const char *path);
+void outputQueueStart(Output *o);
+
+/* writes to an already open descriptor (like a pipe), so the header goes out
+   first and then every block as soon as it's produced */
+Output outputOpenFd(int fd)
+{
+    Output o = { .backend = OUT_STDIO, .path = "(file descriptor)", .fd = -1 };
+#if defined _WIN32
+    _setmode(fd, _O_BINARY);
+    o.file = _fdopen(fd, "wb");
+#else
+    /* a reader that goes away early should end up as a logged write error
+       instead of silently killing the process */
+    signal(SIGPIPE, SIG_IGN);
+    o.file = fdopen(fd, "wb");
+#endif
+    if (o.file == NULL) {
+        loggerAppend(ERR_FATAL, "unable to write to file descriptor %d: %s",
+            fd, strerror(errno));
+        loggerClose(errno);
+        exit(EXIT_FAILURE);
+    }
+
+    outputQueueStart(&o);
+    return o;
+}
+
+Output outputOpen(const char *path, size_t size, OutputBackend backend)
+{
+    Output o;
+    if (!outputTryOpen(&o, path, size, backend)) {
+        loggerAppend(ERR_FATAL, "unable to open file '%s' for writing: %s",
+            path, strerror(errno));
+        loggerClose(errno);
+        exit(EXIT_FAILURE);
+    }
+
+    return o;
+}
+
+/* like outputOpen, but leaves it to the caller to deal with a file that
+   can't be opened (returning false with errno set) */
+bool outputTryOpen(Output *out, const char *path, size_t size,
+    OutputBackend backend)
+{
+    Output o = { .backend = OUT_STDIO, .path = path, .fd = -1, .size = size };
+#if defined _WIN32
+    if (backend == OUT_MMAP || backend == OUT_URING) {
+        loggerAppend(ERR_ARG, "%s output is unsupported on this platform"
+            " (using stdio)", outputBackendToString(backend));
+    }
+#else
+    /* only regular files can be mapped (or written to directly), and
+       reopening anything else (like a FIFO) after a failed attempt could lose
+       its reader */
+    struct stat st;
+    bool regular = stat(path, &st) != 0 || S_ISREG(st.st_mode);
+    if (backend == OUT_URING && regular) {
+        if (outputRingOpen(&o, path)) {
+            *out = o;
+            return true;
+        }
+
+        loggerAppend(ERR_ARG, "unable to use io_uring for '%s': %s"
+            " (using stdio)", path, strerror(errno));
+    } else if (backend == OUT_URING) {
+        loggerAppend(ERR_ARG, "'%s' isn't a regular file (using stdio)",
+            path);
+    }
+
+    if (backend != OUT_STDIO && backend != OUT_URING && size > 0 &&
+        regular) {
+        o.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (o.fd >= 0 && outputMap(&o)) {
+            loggerAppend(LOG_INFO, "output is memory-mapped (%zu bytes)", size);
+            *out = o;
+            return true;
+        }
+
+        if (backend == OUT_MMAP) {
+            loggerAppend(ERR_ARG, "unable to memory-map '%s': %s"
+                " (using stdio)", path, strerror(errno));
+        }
+
+        if (o.fd >= 0) o.file = fdopen(o.fd, "wb");
+        o.fd = -1;
+    } else if (backend == OUT_MMAP) {
+        loggerAppend(ERR_ARG, "'%s' can't be memory-mapped (using stdio)",
+            path);
+    }
+#endif
+
+    if (o.file == NULL) o.file = fopen(path, "wb");
+    if (o.file != NULL) outputQueueStart(&o);
+
+    *out = o;
+    return o.file != NULL;
+}
+
+/* sizes the (already open) regular file up front and maps all of it */
+bool outputMap(Output *o)
+{
+#if defined _WIN32
+    (void)o;
+    return false;
+#else
+#if defined __linux__
+    /* reserving the blocks now turns a full disk into an error here instead
+       of a SIGBUS halfway through writing to the mapping */
+    int err = posix_fallocate(o->fd, 0, (off_t)o->size);
+    if (err == ENOSPC) {
+        loggerAppend(ERR_FATAL, "not enough space for '%s' (%zu bytes)",
+            o->path, o->size);
+        loggerClose(err);
+        exit(EXIT_FAILURE);
+    }
+#endif
+
+    if (ftruncate(o->fd, (off_t)o->size) != 0) return false;
+
+    void *map = mmap(NULL, o->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+        o->fd, 0);
+    if (map == MAP_FAILED) return false;
+
+    o->map = map;
+    o->backend = OUT_MMAP;
+    return true;
+#endif
+}
+
+/* the writer thread of the stdio backend: a ring of blocks, where the one
+   being filled is 'submitted' and the ones before it (down to 'written') are
+   queued up, so a block gets rendered while the previous ones are written */
+#define OUTPUT_QUEUE_BLOCKS 3
+#define OUTPUT_BLOCK_SIZE (KB * KB) // the size blocks are submitted at
+
+typedef struct OutputBlock {
+    uint8_t *buf;
+    size_t size, len;
+} OutputBlock;
+
+struct OutputQueue {
+    FILE *file;
+    OutputBlock blocks[OUTPUT_QUEUE_BLOCKS];
+    size_t fill; // bytes in the block being filled
+    size_t submitted, written;
+    bool quit;
+    Mutex lock;
+    Cond ready, done;
+    Thread writer;
+};
+
+THREAD_FUNC(outputWriter)
+{
+    OutputQueue *q = arg;
+    mutexLock(&q->lock);
+    for (;;) {
+        while (q->written == q->submitted && !q->quit) {
+            condWait(&q->ready, &q->lock);
+        }
+
+        if (q->written == q->submitted) break;
+
+        OutputBlock *block = &q->blocks[q->written % OUTPUT_QUEUE_BLOCKS];
+        mutexUnlock(&q->lock);
+
+        double begin = spanBegin();
+        if (fwrite(block->buf, 1, block->len, q->file) != block->len) {
+            loggerAppend(ERR_FATAL, "unable to write wave to file: %s",
+                strerror(errno));
+            loggerClose(errno);
+            exit(EXIT_FAILURE);
+        }
+
+        spanEnd(SPAN_WRITE, begin);
+        counterAdd(COUNTER_BYTES, block->len);
+
+        mutexLock(&q->lock);
+        q->written += 1;
+        condBroadcast(&q->done);
+    }
+
+    mutexUnlock(&q->lock);
+    return 0;
+}
+
+/* falls back to writing synchronously when the thread can't be started */
+void outputQueueStart(Output *o)
+{
+    OutputQueue *q = calloc(1, sizeof(*q));
+    if (q == NULL) return;
+
+    q->file = o->file;
+    mutexInit(&q->lock);
+    condInit(&q->ready);
+    condInit(&q->done);
+    if (!threadCreate(&q->writer, outputWriter, q)) {
+        mutexDestroy(&q->lock);
+        condDestroy(&q->ready);
+        condDestroy(&q->done);
+        free(q);
+        return;
+    }
+
+    o->queue = q;
+}
+
+/* hands the block being filled over to the writer */
+void outputQueueSubmit(OutputQueue *q)
+{
+    mutexLock(&q->lock);
+    q->blocks[q->submitted % OUTPUT_QUEUE_BLOCKS].len = q->fill;
+    q->fill = 0;
+    q->submitted += 1;
+    condBroadcast(&q->ready);
+    mutexUnlock(&q->lock);
+}
+
+void *outputQueueAcquire(OutputQueue *q, size_t bytes)
+{
+    OutputBlock *block = &q->blocks[q->submitted % OUTPUT_QUEUE_BLOCKS];
+    if (q->fill > 0 && q->fill + bytes > block->size) {
+        outputQueueSubmit(q);
+        block = &q->blocks[q->submitted % OUTPUT_QUEUE_BLOCKS];
+    }
+
+    /* a new block is free once the writer is done with its previous use */
+    if (q->fill == 0) {
+        mutexLock(&q->lock);
+        while (q->submitted - q->written >= OUTPUT_QUEUE_BLOCKS) {
+            condWait(&q->done, &q->lock);
+        }
+
+        mutexUnlock(&q->lock);
+    }
+
+    if (q->fill + bytes > block->size) {
+        size_t size = bytes > OUTPUT_BLOCK_SIZE ? bytes : OUTPUT_BLOCK_SIZE;
+        uint8_t *buf = realloc(block->buf, size);
+        if (buf == NULL) {
+            ERR_OUT_OF_MEMORY();
+            exit(EXIT_FAILURE);
+        }
+
+        block->buf = buf;
+        block->size = size;
+    }
+
+    return block->buf + q->fill;
+}
+
+void outputQueueCommit(OutputQueue *q, size_t bytes)
+{
+    q->fill += bytes;
+    if (q->fill >= OUTPUT_BLOCK_SIZE) outputQueueSubmit(q);
+}
+
+/* writes out whatever is left and waits for the writer to finish */
+void outputQueueClose(OutputQueue *q)
+{
+    if (q->fill > 0) outputQueueSubmit(q);
+
+    mutexLock(&q->lock);
+    q->quit = true;
+    condBroadcast(&q->ready);
+    mutexUnlock(&q->lock);
+    threadJoin(q->writer);
+
+    for (size_t i = 0; i < OUTPUT_QUEUE_BLOCKS; i++) free(q->blocks[i].buf);
+    mutexDestroy(&q->lock);
+    condDestroy(&q->ready);
+    condDestroy(&q->done);
+    free(q);
+}
+
+/* the uring backend: a few buffers, registered with the kernel once, that
+   are filled in turn and written with fixed-buffer writes while the next one
+   is being filled, bypassing the page cache (O_DIRECT) when the filesystem
+   allows it, in which case every write but the last must be a whole number
+   of (aligned) blocks, so whatever doesn't fill one is carried over */
+#define URING_BUFFERS 4
+#define URING_BUFFER_SIZE (4 * KB * KB)
+#define URING_ALIGN (4 * KB)
+
+#if defined HAVE_IO_URING
+struct OutputRing {
+    int ringFd, fd;
+    bool direct;
+    /* the submission and completion rings, shared with the kernel */
+    uint8_t *sqMap, *cqMap;
+    size_t sqMapSize, cqMapSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    uint8_t *buffers[URING_BUFFERS];
+    size_t lengths[URING_BUFFERS]; // of the write in flight
+    uint64_t offsets[URING_BUFFERS];
+    bool busy[URING_BUFFERS];
+    bool directs[URING_BUFFERS]; // whether it went out with O_DIRECT
+    size_t current, fill;
+    uint64_t fileOffset; // where the next write goes
+    uint8_t *staging; // for requests that don't fit a buffer
+    size_t stagingSize, staged;
+};
+
+void outputRingDestroy(OutputRing *r)
+{
+    if (r->ringFd >= 0) close(r->ringFd);
+    if (r->sqes != NULL) munmap(r->sqes, r->sqesSize);
+    if (r->cqMap != NULL && r->cqMap != r->sqMap) {
+        munmap(r->cqMap, r->cqMapSize);
+    }
+
+    if (r->sqMap != NULL) munmap(r->sqMap, r->sqMapSize);
+    for (size_t i = 0; i < URING_BUFFERS; i++) free(r->buffers[i]);
+    free(r->staging);
+    free(r);
+}
+
+/* sets up the rings and registers the buffers, returning NULL (with errno
+   set) when io_uring isn't available */
+OutputRing *outputRingCreate(int fd, bool direct)
+{
+    OutputRing *r = calloc(1, sizeof(*r));
+    if (r == NULL) return NULL;
+
+    r->fd = fd;
+    r->direct = direct;
+    struct io_uring_params params = {0};
+    r->ringFd = (int)syscall(__NR_io_uring_setup, URING_BUFFERS, &params);
+    if (r->ringFd < 0) {
+        int err = errno;
+        free(r);
+        errno = err;
+        return NULL;
+    }
+
+    r->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cqMapSize = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cqMapSize > r->sqMapSize) r->sqMapSize = r->cqMapSize;
+        r->cqMapSize = r->sqMapSize;
+    }
+
+    void *sq = mmap(NULL, r->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+        r->ringFd, IORING_OFF_SQ_RING);
+    r->sqMap = sq == MAP_FAILED ? NULL : sq;
+    void *cq = params.features & IORING_FEAT_SINGLE_MMAP ? sq :
+        mmap(NULL, r->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+            r->ringFd, IORING_OFF_CQ_RING);
+    r->cqMap = cq == MAP_FAILED ? NULL : cq;
+    r->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, r->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+        r->ringFd, IORING_OFF_SQES);
+    r->sqes = sqes == MAP_FAILED ? NULL : sqes;
+    if (r->sqMap == NULL || r->cqMap == NULL || r->sqes == NULL) {
+        int err = errno;
+        outputRingDestroy(r);
+        errno = err;
+        return NULL;
+    }
+
+    r->sqTail = (unsigned*)(r->sqMap + params.sq_off.tail);
+    r->sqMask = (unsigned*)(r->sqMap + params.sq_off.ring_mask);
+    r->sqArray = (unsigned*)(r->sqMap + params.sq_off.array);
+    r->cqHead = (unsigned*)(r->cqMap + params.cq_off.head);
+    r->cqTail = (unsigned*)(r->cqMap + params.cq_off.tail);
+    r->cqMask = (unsigned*)(r->cqMap + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(r->cqMap + params.cq_off.cqes);
+
+    struct iovec iov[URING_BUFFERS];
+    for (size_t i = 0; i < URING_BUFFERS; i++) {
+        void *buf = NULL;
+        if (posix_memalign(&buf, URING_ALIGN, URING_BUFFER_SIZE) != 0) {
+            outputRingDestroy(r);
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        r->buffers[i] = buf;
+        iov[i] = (struct iovec){ .iov_base = buf, .iov_len = URING_BUFFER_SIZE };
+    }
+
+    if (syscall(__NR_io_uring_register, r->ringFd, IORING_REGISTER_BUFFERS,
+        iov, URING_BUFFERS) != 0) {
+        int err = errno;
+        outputRingDestroy(r);
+        errno = err;
+        return NULL;
+    }
+
+    return r;
+}
+
+/* handles the writes that completed, waiting for at least 'wait' of them */
+void outputRingReap(OutputRing *r, unsigned wait)
+{
+    if (wait > 0) {
+        double begin = spanBegin();
+        while (syscall(__NR_io_uring_enter, r->ringFd, 0, wait,
+            IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno == EINTR) {
+            continue;
+        }
+
+        spanEnd(SPAN_WRITE, begin);
+    }
+
+    unsigned head = *r->cqHead;
+    unsigned tail = __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &r->cqes[head & *r->cqMask];
+        size_t i = (size_t)cqe->user_data;
+        int res = cqe->res;
+
+        /* some filesystems only refuse direct I/O once it's attempted, in
+           which case the file goes back to the page cache for good, and
+           every write that was already in flight with it is redone */
+        if (res == -EINVAL && r->directs[i] && r->direct) {
+            int flags = fcntl(r->fd, F_GETFL);
+            if (flags != -1 && fcntl(r->fd, F_SETFL, flags & ~O_DIRECT) == 0) {
+                loggerAppend(ERR_ARG, "direct I/O was refused (going through"
+                    " the page cache)");
+                r->direct = false;
+            }
+        }
+
+        if (res == -EINVAL && r->directs[i] && !r->direct) {
+            res = (int)pwrite(r->fd, r->buffers[i], r->lengths[i],
+                (off_t)r->offsets[i]);
+            if (res < 0) res = -errno;
+        }
+
+        if (res < 0 || (size_t)res != r->lengths[i]) {
+            loggerAppend(ERR_FATAL, "unable to write wave to file: %s",
+                res < 0 ? strerror(-res) : "short write");
+            loggerClose(res < 0 ? -res : EIO);
+            exit(EXIT_FAILURE);
+        }
+
+        counterAdd(COUNTER_BYTES, r->lengths[i]);
+        r->busy[i] = false;
+    }
+
+    __atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+}
+
+/* writes the first 'len' bytes of the current buffer at the end of the file
+   and moves on to the next buffer, carrying the rest of 'fill' over */
+void outputRingSubmit(OutputRing *r, size_t len)
+{
+    size_t i = r->current;
+    unsigned tail = *r->sqTail;
+    unsigned index = tail & *r->sqMask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = r->fd;
+    sqe->addr = (uint64_t)(uintptr_t)r->buffers[i];
+    sqe->len = (uint32_t)len;
+    sqe->off = r->fileOffset;
+    sqe->buf_index = (uint16_t)i;
+    sqe->user_data = i;
+    r->sqArray[index] = index;
+    __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    r->lengths[i] = len;
+    r->offsets[i] = r->fileOffset;
+    r->busy[i] = true;
+    r->directs[i] = r->direct;
+    r->fileOffset += len;
+    double begin = spanBegin();
+    while (syscall(__NR_io_uring_enter, r->ringFd, 1, 0, 0, NULL, 0) < 0) {
+        if (errno == EINTR) continue;
+
+        loggerAppend(ERR_FATAL, "unable to submit write: %s",
+            strerror(errno));
+        loggerClose(errno);
+        exit(EXIT_FAILURE);
+    }
+
+    spanEnd(SPAN_WRITE, begin);
+
+    /* the next buffer must be done with its previous write first */
+    size_t next = (i + 1) % URING_BUFFERS;
+    outputRingReap(r, 0);
+    while (r->busy[next]) outputRingReap(r, 1);
+
+    size_t carry = r->fill - len;
+    memcpy(r->buffers[next], r->buffers[i] + len, carry);
+    r->current = next;
+    r->fill = carry;
+}
+
+/* what can be written without breaking the alignment direct I/O needs */
+size_t outputRingWritable(const OutputRing *r)
+{
+    return r->direct ? r->fill & ~(size_t)(URING_ALIGN - 1) : r->fill;
+}
+
+void *outputRingAcquire(OutputRing *r, size_t bytes)
+{
+    /* there must always be room to carry an unaligned tail over */
+    if (bytes > URING_BUFFER_SIZE - URING_ALIGN) {
+        if (bytes > r->stagingSize) {
+            uint8_t *staging = realloc(r->staging, bytes);
+            if (staging == NULL) {
+                ERR_OUT_OF_MEMORY();
+                exit(EXIT_FAILURE);
+            }
+
+            r->staging = staging;
+            r->stagingSize = bytes;
+        }
+
+        r->staged = bytes;
+        return r->staging;
+    }
+
+    if (r->fill + bytes > URING_BUFFER_SIZE) {
+        outputRingSubmit(r, outputRingWritable(r));
+    }
+
+    return r->buffers[r->current] + r->fill;
+}
+
+void outputRingWrite(OutputRing *r, const uint8_t *src, size_t bytes)
+{
+    const size_t step = URING_BUFFER_SIZE - URING_ALIGN;
+    while (bytes > 0) {
+        size_t n = bytes < step ? bytes : step;
+        memcpy(outputRingAcquire(r, n), src, n);
+        r->fill += n;
+        src += n, bytes -= n;
+    }
+}
+
+void outputRingCommit(OutputRing *r, size_t bytes)
+{
+    if (r->staged > 0) {
+        r->staged = 0;
+        outputRingWrite(r, r->staging, bytes);
+        return;
+    }
+
+    r->fill += bytes;
+    if (r->fill == URING_BUFFER_SIZE) outputRingSubmit(r, r->fill);
+}
+
+/* writes out what's left (padded to a whole block for direct I/O, which the
+   file is then truncated back from) and waits for every write to land */
+void outputRingClose(OutputRing *r)
+{
+    uint64_t size = r->fileOffset + r->fill;
+    if (r->fill > 0) {
+        size_t len = r->fill;
+        if (r->direct) {
+            len = (len + URING_ALIGN - 1) & ~(size_t)(URING_ALIGN - 1);
+            memset(r->buffers[r->current] + r->fill, 0, len - r->fill);
+            r->fill = len;
+        }
+
+        outputRingSubmit(r, len);
+    }
+
+    for (size_t i = 0; i < URING_BUFFERS; i++) {
+        while (r->busy[i]) outputRingReap(r, 1);
+    }
+
+    if (r->fileOffset != size && ftruncate(r->fd, (off_t)size) != 0) {
+        loggerAppend(ERR_FATAL, "unable to truncate the wave's padding: %s",
+            strerror(errno));
+        loggerClose(errno);
+        exit(EXIT_FAILURE);
+    }
+
+    outputRingDestroy(r);
+}
+
+/* opens 'path' for the uring backend, falling back to the page cache when
+   O_DIRECT is refused, and returns false (with errno set) when io_uring
+   can't be used */
+bool outputRingOpen(Output *o, const char *path)
+{
+    bool direct = true;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (fd < 0 && errno == EINVAL) {
+        direct = false;
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+
+    if (fd < 0) return false;
+
+    OutputRing *r = outputRingCreate(fd, direct);
+    if (r == NULL) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return false;
+    }
+
+    o->ring = r;
+    o->fd = fd;
+    o->backend = OUT_URING;
+    loggerAppend(LOG_INFO, "output goes through io_uring (%s)",
+        direct ? "direct I/O" : "page cache");
+    return true;
+}
+#else
+bool outputRingOpen(Output *o, const char *path)
+{
+    (void)o, (void)path;
+    errno = ENOSYS;
+    return false;
+}
+
+void *outputRingAcquire(OutputRing *r, size_t bytes)
+{
+    (void)r, (void)bytes;
+    return NULL;
+}
+
+void outputRingCommit(OutputRing *r, size_t bytes)
+{
+    (void)r, (void)bytes;
+}
+
+void outputRingWrite(OutputRing *r, const uint8_t *src, size_t bytes)
+{
+    (void)r, (void)src, (void)bytes;
+}
+
+void outputRingClose(OutputRing *r)
+{
+    (void)r;
+}
+#endif
+
+/* returns where the next 'bytes' bytes of output are to be written to */
+void *outputAcquire(Output *o, size_t bytes)
+{
+    if (o->map != NULL) {
+        if (o->offset + bytes > o->size) {
+            loggerAppend(ERR_FATAL, "attempted to write past the end of '%s'",
+                o->path);
+            loggerClose(EXIT_FAILURE);
+            exit(EXIT_FAILURE);
+        }
+
+        return o->map + o->offset;
+    }
+
+    if (o->queue != NULL) return outputQueueAcquire(o->queue, bytes);
+    if (o->ring != NULL) return outputRingAcquire(o->ring, bytes);
+
+    if (bytes > o->stagingSize) {
+        uint8_t *staging = realloc(o->staging, bytes);
+        if (staging == NULL) {
+            ERR_OUT_OF_MEMORY();
+            exit(EXIT_FAILURE);
+        }
+
+        o->staging = staging;
+        o->stagingSize = bytes;
+    }
+
+    return o->staging;
+}
+
+/* writes out the 'bytes' bytes placed where outputAcquire pointed to */
+void outputCommit(Output *o, size_t bytes)
+{
+    if (o->queue != NULL || o->ring != NULL) {
+        if (o->queue != NULL) outputQueueCommit(o->queue, bytes);
+        else outputRingCommit(o->ring, bytes);
+
+        o->offset += bytes;
+        return;
+    }
+
+    double begin = spanBegin();
+    if (o->map == NULL && fwrite(o->staging, 1, bytes, o->file) != bytes) {
+        loggerAppend(ERR_FATAL, "unable to write wave to file: %s",
+            strerror(errno));
+        loggerClose(errno);
+        exit(EXIT_FAILURE);
+    }
+
+    o->offset += bytes;
+    spanEnd(SPAN_WRITE, begin);
+    counterAdd(COUNTER_BYTES, bytes);
+}
+
+void outputWrite(Output *o, const void *buf, size_t bytes)
+{
+    /* copied into the queue's blocks, a block's worth at a time */
+    for (const uint8_t *src = buf; o->queue != NULL && bytes > 0;) {
+        size_t n = bytes < OUTPUT_BLOCK_SIZE ? bytes : OUTPUT_BLOCK_SIZE;
+        memcpy(outputQueueAcquire(o->queue, n), src, n);
+        outputCommit(o, n);
+        src += n, bytes -= n;
+    }
+
+    if (o->queue != NULL) return;
+
+    if (o->ring != NULL) {
+        outputRingWrite(o->ring, buf, bytes);
+        o->offset += bytes;
+        return;
+    }
+
+    double begin = spanBegin();
+    if (o->map == NULL) {
+        if (fwrite(buf, 1, bytes, o->file) != bytes) {
+            loggerAppend(ERR_FATAL, "unable to write wave to file: %s",
+                strerror(errno));
+            loggerClose(errno);
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        memcpy(outputAcquire(o, bytes), buf, bytes);
+    }
+
+    o->offset += bytes;
+    spanEnd(SPAN_WRITE, begin);
+    counterAdd(COUNTER_BYTES, bytes);
+}
+
+void outputClose(Output *o)
+{
+#if !defined _WIN32
+    if (o->map != NULL) {
+        munmap(o->map, o->size);
+        close(o->fd);
+    }
+#endif
+
+    if (o->queue != NULL) outputQueueClose(o->queue);
+    if (o->ring != NULL) {
+        outputRingClose(o->ring);
+        close(o->fd);
+    }
+
+    if (o->file != NULL) fclose(o->file);
+    free(o->staging);
+    memset(o, 0, sizeof(*o));
+}
+
+void audioBufferDestroy(AudioBuffer *b)
+{
+    samplesFree(b->buf);
+    memset(b, 0, sizeof(*b));
 }
 
 #define MINUS_INF_DB -150.0